@@ -0,0 +1,135 @@
+// Benchmark of one backend: training, merge, save/load and generation with latency percentiles.
+// Uses the same input classes as frontend, so numbers include real I/O path.
+
+#include <generatorAPI.hpp>
+#include "../main/mainDefs.hpp"
+#include "../main/Input.hpp"
+#include "../main/Stats.hpp"
+
+#include <iomanip>
+#include <boost/program_options.hpp>
+
+namespace po = boost::program_options;
+namespace dll = boost::dll;
+
+static void report(std::string phase, phaseTimer& timer, std::string extra = "") {
+	std::cout << std::left << std::setw(8) << phase << std::right << std::fixed << std::setprecision(3)
+			  << " wall " << std::setw(9) << timer.wall() << " s, cpu " << std::setw(9) << timer.cpu() << " s" << extra << std::endl;
+	}
+
+static std::string rate(double value, double seconds, std::string unit) {
+	std::ostringstream res;
+	res << std::fixed << std::setprecision(2) << ", " << (seconds > 0 ? value / seconds : 0) << " " << unit << "/s";
+	return res.str();
+	}
+
+int main(int ac, char* av[]) {
+	try {
+			po::options_description desc("Backend benchmark");
+			desc.add_options()
+			("backend,b", po::value<std::string>()->required(), "path to backend")
+			("backend-opts,p", po::value<std::vector<std::string>>()->default_value(std::vector<std::string>(), "empty"), "parametrs to backend (can be used multiplie times)")
+			("jobs,j", po::value<unsigned int>()->default_value(1), "threads for training (1 per file)")
+			("count,n", po::value<unsigned long long>()->default_value(1000), "count of outputs to generate")
+			("cache-file,f", po::value<std::string>()->default_value("bench.cache"), "cache file for save/load")
+			("help,h", "print help message");
+			po::options_description hidden;
+			hidden.add_options()
+			("input-files", po::value<std::vector<std::string>>()->required(), "corpus files");
+			po::options_description all;
+			all.add(desc).add(hidden);
+			po::positional_options_description p;
+			p.add("input-files", -1);
+			po::variables_map vm;
+			po::store(po::command_line_parser(ac, av).options(all).positional(p).run(), vm);
+			if (vm.count("help")) {
+					std::cout << "Usage: " << av[0] << " -b BACKEND [options] CORPUS..." << std::endl << desc << std::endl;
+					return EXIT_SUCCESS;
+					}
+			po::notify(vm);
+
+			opts o;
+			o.mmap_min = 16 << 20;
+			o.buffer_size = 16 << 20;
+			std::string cachefile = vm["cache-file"].as<std::string>();
+			unsigned long long count = vm["count"].as<unsigned long long>();
+
+			std::cout << "Backend " << vm["backend"].as<std::string>() << std::endl;
+			boost::shared_ptr<generatorAPI> backend;
+				{
+				phaseTimer timer;
+				backend = dll::import_alias<generatorAPI>(vm["backend"].as<std::string>(), "backendInterface", dll::load_mode::default_mode);
+				backend->init(vm["backend-opts"].as<std::vector<std::string>>());
+				report("init", timer);
+				}
+
+			std::vector<std::shared_ptr<generatorInput>> inputs;
+			double bytes = 0;
+			for (auto const& fname: vm["input-files"].as<std::vector<std::string>>()) {
+					inputs.push_back(openInput(fname, o));
+					bytes += inputs.back()->size();
+					}
+
+			std::vector<boost::any> results;
+				{
+				phaseTimer timer;
+				backend->trainBegin(inputs);
+				std::mutex mutex;
+				boost::asio::thread_pool pool(vm["jobs"].as<unsigned int>());
+				for (auto& input: inputs) {
+						boost::asio::post(pool, [&backend, &results, &mutex, input]() {
+							boost::any res = backend->train(input);
+							std::lock_guard<std::mutex> lock(mutex);
+							results.push_back(std::move(res));
+							});
+						}
+				pool.join();
+				double tokens = backend->getCounters()["train.tokens"];
+				report("train", timer, rate(bytes / (1 << 20), timer.wall(), "MiB") + rate(tokens, timer.wall(), "tokens"));
+				}
+
+			boost::any data;
+				{
+				phaseTimer timer;
+				data = backend->merge(results);
+				results.clear();
+				report("merge", timer);
+				}
+				{
+				phaseTimer timer;
+				backend->save(cachefile, data);
+				report("save", timer);
+				}
+			data = boost::any();
+				{
+				phaseTimer timer;
+				data = backend->load(cachefile);
+				report("load", timer);
+				}
+
+			std::vector<double> latencies;
+			double tokensBefore = backend->getCounters()["out.tokens"];
+			phaseTimer outTimer;
+			for (unsigned long long i = 0; i < count; ++i) {
+					std::vector<std::shared_ptr<std::ostream>> outs{std::make_shared<std::ostringstream>()};
+					phaseTimer timer;
+					backend->outBatch(data, outs, i); // Output number i has own seed, so every iteration is another walk (`out` is always output 0)
+					latencies.push_back(timer.wall());
+					}
+			double tokens = backend->getCounters()["out.tokens"] - tokensBefore;
+			report("out", outTimer, rate(count, outTimer.wall(), "outputs") + rate(tokens, outTimer.wall(), "tokens"));
+
+			std::sort(latencies.begin(), latencies.end());
+			auto percentile = [&latencies](double p) { return latencies[std::min<size_t>(latencies.size() - 1, p * latencies.size())] * 1e6; };
+			if (!latencies.empty()) {
+					std::cout << std::fixed << std::setprecision(1) << "latency  p50 " << percentile(0.5) << " us, p90 " << percentile(0.9)
+							  << " us, p99 " << percentile(0.99) << " us, max " << latencies.back() * 1e6 << " us" << std::endl;
+					}
+			return EXIT_SUCCESS;
+			}
+	catch (std::exception& e) {
+			std::cerr << "Error: " << e.what() << std::endl;
+			return EXIT_FAILURE;
+			}
+	}
+// kate: indent-mode cstyle; indent-width 4; replace-tabs off; tab-width 4; 
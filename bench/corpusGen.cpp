@@ -0,0 +1,111 @@
+// Reproducible synthetic corpus: words with Zipf-distributed frequencies, lines of random length, paragraphs divided by empty line.
+// Same options and seed give same corpus: only std::mt19937_64 (its sequence is fixed by standard) is used, no std:: distributions.
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <random>
+
+#include <boost/program_options.hpp>
+
+namespace po = boost::program_options;
+
+class corpusRandom {
+	public:
+		explicit corpusRandom(std::uint64_t seed): gen(seed) {};
+		double real() { return (gen() >> 11) * (1.0 / 9007199254740992.0); } // [0, 1)
+		std::uint64_t range(std::uint64_t from, std::uint64_t to) { return from + (std::uint64_t)(real() * (to - from + 1)); } // [from, to]
+
+	private:
+		std::mt19937_64 gen; // Sequence is fixed by standard, unlike distributions
+	};
+
+static std::string makeWord(std::uint64_t rank) { // Distinct, pronounceable-ish, length grows with rank like in real text
+	static const char consonants[] = "bcdfghklmnprstvz";
+	static const char vowels[] = "aeiou";
+	std::string res;
+	do {
+			res += consonants[rank % 16];
+			rank /= 16;
+			res += vowels[rank % 5];
+			rank /= 5;
+			} while (rank > 0);
+	return res;
+	}
+
+int main(int ac, char* av[]) {
+	try {
+			po::options_description desc("Synthetic corpus generator");
+			desc.add_options()
+			("output,o", po::value<std::string>(), "output file (stdout by default)")
+			("size,s", po::value<std::uint64_t>()->default_value(16 << 20), "approximate size in bytes")
+			("vocab,v", po::value<std::uint64_t>()->default_value(10000), "count of distinct words")
+			("zipf,z", po::value<double>()->default_value(1.0), "Zipf skew (0 = uniform, 1 = natural language)")
+			("line-min", po::value<std::uint64_t>()->default_value(4), "minimal count of words in line")
+			("line-max", po::value<std::uint64_t>()->default_value(16), "maximal count of words in line")
+			("paragraph", po::value<std::uint64_t>()->default_value(4), "lines in paragraph (paragraphs are divided by empty line), 0 = no paragraphs")
+			("seed", po::value<std::uint64_t>()->default_value(1), "random seed")
+			("help,h", "print help message");
+			po::variables_map vm;
+			po::store(po::parse_command_line(ac, av, desc), vm);
+			if (vm.count("help")) {
+					std::cout << desc << std::endl;
+					return EXIT_SUCCESS;
+					}
+			po::notify(vm);
+
+			std::uint64_t size = vm["size"].as<std::uint64_t>();
+			std::uint64_t vocab = vm["vocab"].as<std::uint64_t>();
+			double zipf = vm["zipf"].as<double>();
+			std::uint64_t lineMin = vm["line-min"].as<std::uint64_t>();
+			std::uint64_t lineMax = vm["line-max"].as<std::uint64_t>();
+			std::uint64_t paragraph = vm["paragraph"].as<std::uint64_t>();
+			if (vocab == 0 or lineMin == 0 or lineMin > lineMax) {
+					throw std::invalid_argument("vocabulary and line length must be positive, line-min must not exceed line-max");
+					}
+
+			std::vector<std::string> words;
+			std::vector<double> cumulative; // Zipf CDF
+			double sum = 0;
+			for (std::uint64_t i = 0; i < vocab; ++i) {
+					words.push_back(makeWord(i));
+					sum += 1.0 / std::pow(i + 1, zipf);
+					cumulative.push_back(sum);
+					}
+
+			std::ofstream file;
+			if (vm.count("output")) {
+					file.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+					file.open(vm["output"].as<std::string>(), std::ofstream::trunc | std::ofstream::binary);
+					}
+			std::ostream& out = vm.count("output") ? file : std::cout;
+
+			corpusRandom rnd(vm["seed"].as<std::uint64_t>());
+			std::uint64_t written = 0, lines = 0;
+			std::string line;
+			while (written < size) {
+					line.clear();
+					std::uint64_t len = rnd.range(lineMin, lineMax);
+					for (std::uint64_t i = 0; i < len; ++i) {
+							auto it = std::upper_bound(cumulative.begin(), cumulative.end(), rnd.real() * sum);
+							line += words[std::min<std::uint64_t>(it - cumulative.begin(), vocab - 1)];
+							line += i + 1 < len ? ' ' : '\n';
+							}
+					if (paragraph > 0 and ++lines % paragraph == 0) {
+							line += '\n';
+							}
+					out << line;
+					written += line.size();
+					}
+			return EXIT_SUCCESS;
+			}
+	catch (std::exception& e) {
+			std::cerr << "Error: " << e.what() << std::endl;
+			return EXIT_FAILURE;
+			}
+	}
+// kate: indent-mode cstyle; indent-width 4; replace-tabs off; tab-width 4; 
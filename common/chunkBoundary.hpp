@@ -0,0 +1,31 @@
+#pragma once
+
+#include <string_view>
+#include <boost/regex.hpp>
+
+// Helper for backends that split text by `separator` (and lines with `splitstr`): position right after first block boundary
+// in piece of input file that is safe to cut at, npos if there is none. Implements `generatorAPI::chunkBoundary` for them.
+inline std::string_view::size_type markovChunkBoundary(std::string_view data, const boost::regex& separator, bool splitstr) {
+	// Parts split by separator are trained independently, so cutting there changes nothing.
+	// Lines are not (context goes through them), so with splitstr only it is a bit lossy.
+	boost::regex bound;
+	if (separator != boost::regex("")) {
+		bound = separator;
+	} else if (splitstr) {
+		bound = boost::regex("\n+");
+	} else {
+		return std::string_view::npos;
+	}
+	std::string_view::size_type prevEnd = 0;
+	for (boost::cregex_iterator it(data.data(), data.data() + data.size(), bound), itEnd; it != itEnd; ++it) {
+		std::string_view::size_type pos = it->position(), end = pos + it->length();
+		// Match at the beginning (or glued to it) may be tail of longer one, match at the end may continue further
+		if (pos != prevEnd and end < data.size()) {
+			return end;
+		}
+		prevEnd = end;
+	}
+	return std::string_view::npos;
+}
+
+// kate: indent-mode cstyle; indent-width 4; replace-tabs off; tab-width 4;
@@ -2,27 +2,165 @@
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <vector>
 #include <string>
+#include <string_view>
+#include <cstdint>
 #include <algorithm>
 #include <memory>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <random>
+#include <chrono>
+#include <limits>
 
 #include <boost/any.hpp>
 
+#include "generatorTrace.hpp"
+#include "generatorRandom.hpp"
+
+class generatorInput { // Source of training data: whole file mapped into memory or bounded buffer refilled on every `read`
+	public:
+		generatorInput() {};
+		virtual ~generatorInput() {};
+
+		virtual std::string name() = 0; // Human-readable name for messages
+		virtual std::uintmax_t size() = 0; // Size of data in bytes (bytes read so far if input is not rewindable)
+		virtual bool read(std::string_view&) = 0; // Arguments: view to point at next piece of data (valid until next call); returns false when there is no more data
+		virtual bool eof() = 0; // True if last piece was already given by `read`
+		virtual void rewind() = 0; // Start reading from the beginning again
+		virtual bool rewindable() { return true; }; // False for stdin and pipes: they can be read only once, their size is unknown in advance
+	};
+
+class generatorState { // One generation in progress, made by `outBegin` of backend; used by one thread at a time
+	public:
+		virtual ~generatorState() {};
+	};
+
+class wholeOutState: public generatorState { // Default for backends that only implement `out`: whole result is one piece
+	public:
+		std::string text;
+		bool given = false;
+	};
+
+struct outBudget { // Limits of one output, see `generatorAPI::outLimited`
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+	std::uintmax_t bytes = std::numeric_limits<std::uintmax_t>::max();
+
+	bool limited() const { return deadline != std::chrono::steady_clock::time_point::max() or bytes != std::numeric_limits<std::uintmax_t>::max(); }
+	bool expired() const { return deadline != std::chrono::steady_clock::time_point::max() and std::chrono::steady_clock::now() >= deadline; }
+	bool fits(std::uintmax_t written, std::size_t piece) const { return piece <= bytes - written; } // `written` never exceeds `bytes`
+	};
+
+// Data is passed as boost::any, which may hold whole model: backends should any_cast it to reference and move it, never copy.
 class generatorAPI {
 	public:
-		generatorAPI() {};
+		generatorAPI(): baseSeed(std::random_device()()) {};
 		virtual ~generatorAPI() {};
 
 		virtual void init(std::vector<std::string>) = 0; // Arguments: backend-options from cmd
 
-		virtual void trainBegin(std::vector<std::shared_ptr<std::ifstream>>) = 0; // Arguments: vector of smart pointers to input files
-		virtual boost::any train(std::shared_ptr<std::ifstream>) = 0; // Arguments: smart pointer to input file
-		virtual boost::any merge(std::vector<boost::any>&) = 0; // Arguments: vector of results from `train`
-		virtual void out(boost::any&, std::shared_ptr<std::ostream>) = 0; // Arguments: value from `merge` or `load`, smart pointer to output file
+		virtual void trainBegin(std::vector<std::shared_ptr<generatorInput>>) = 0; // Arguments: vector of smart pointers to inputs (rewind them if you read them, leave not rewindable ones for `train`)
+		virtual boost::any train(std::shared_ptr<generatorInput>) = 0; // Arguments: smart pointer to input (whole file or its chunk)
+		virtual boost::any merge(std::vector<boost::any>&) = 0; // Arguments: vector of results from `train` (may be moved from, frontend drops them after)
+		virtual void out(boost::any&, std::shared_ptr<std::ostream>) = 0; // Arguments: value from `merge` or `load`, smart pointer to output file (it is output number 0, see `outputSeed`)
 
 		virtual boost::any load(std::string) = 0; // Arguments: filename to load from
 		virtual void save(std::string, boost::any&) = 0; // Arguments: filename to save to, data from `merge`
+
+		// Statistics: backend adds its counters (tokens, queries, ...) by `count`, frontend reports them.
+		// Standard names are `train.tokens` and `out.tokens`. Call it once per `train`/`out`, not per token.
+		void count(const std::string& name, double value = 1) {
+			std::lock_guard<std::mutex> lock(countersMutex);
+			counters[std::this_thread::get_id()][name] += value;
+			}
+		std::map<std::string, double> getCounters() { // Sum for all threads
+			std::lock_guard<std::mutex> lock(countersMutex);
+			std::map<std::string, double> res;
+			for (auto const& thread: counters) {
+				for (auto const& counter: thread.second) {
+					res[counter.first] += counter.second;
+					}
+				}
+			return res;
+			}
+		std::map<std::string, double> getThreadCounters() { // Only ones added by calling thread
+			std::lock_guard<std::mutex> lock(countersMutex);
+			return counters[std::this_thread::get_id()];
+			}
+
+		// Randomness: every output has own generator seeded by `outputSeed(number of output)`, derived from frontend's `--seed`.
+		// So results are the same for the same seed regardless of threads, and threads never share generator.
+		void setSeed(std::uint64_t seed) { baseSeed = seed; }
+		std::uint64_t outputSeed(std::uint64_t index) { return generatorRandom::mix(baseSeed, index); }
+
+		// Tracing: backend marks its hot spots with `TRACE_SPAN(trace, "name")`, frontend enables log and writes it.
+		traceLog trace;
+
+		// Optional: pulling output piece by piece, to stream it or stop by own criterion (just drop state).
+		// `outNext` is called with state from `outBegin` until it returns false. Threads: same rules as for `out`.
+		virtual std::unique_ptr<generatorState> outBegin(boost::any& data, std::uint64_t) { // Arguments: value from `merge` or `load`, seed for generator
+			auto stream = std::make_shared<std::ostringstream>();
+			out(data, stream);
+			auto state = std::make_unique<wholeOutState>();
+			state->text = stream->str();
+			return state;
+			}
+		virtual bool outNext(generatorState& state, std::string& piece) { // Arguments: state from `outBegin`, string to put next piece (token with separator) into; returns false when output is finished
+			auto& whole = static_cast<wholeOutState&>(state);
+			if (whole.given) {
+				return false;
+				}
+			piece = std::move(whole.text);
+			whole.given = true;
+			return true;
+			}
+
+		// Generation under budget: stops at piece (token) boundary when deadline passes or next piece does not fit into byte limit.
+		// Deadline is checked before every step, so it may be overrun by one step (one query for SQL backends). Returns true if output was truncated.
+		bool outLimited(boost::any& data, std::ostream& o, std::uint64_t seed, outBudget const& budget) {
+			auto state = outBegin(data, seed);
+			std::string piece;
+			std::uintmax_t written = 0;
+			for (;;) {
+				if (budget.expired()) {
+					return true;
+					}
+				if (!outNext(*state, piece)) {
+					return false;
+					}
+				if (!budget.fits(written, piece.size())) {
+					return true;
+					}
+				o << piece;
+				written += piece.size();
+				}
+			}
+
+		// Optional: generating many outputs from one model. If `outConcurrent` is true, `outBatch` is called from several threads at once.
+		virtual void outBatch(boost::any& data, std::vector<std::shared_ptr<std::ostream>>& outs, std::uint64_t) { for (auto& o: outs) { out(data, o); } } // Arguments: value from `merge` or `load`, outputs to fill (one result each), number of first output
+		virtual bool outConcurrent() { return false; }
+
+		// Optional: merging partial results. If true, `merge` is also called (from several threads at once) on pairs of results as they become ready. Final `merge` is called anyway.
+		virtual bool mergeIncremental() { return false; }
+
+		// Optional: training one file by chunks in parallel. Chunks are passed to `train` as usual inputs.
+		virtual std::string_view::size_type chunkBoundary(std::string_view) { return std::string_view::npos; } // Arguments: piece of input file; returns position right after first block boundary in it (npos if none found or splitting is not supported)
+
+		// Optional: appending to cache without rewriting it. If `appendDelta` is true, append mode trains only new inputs and passes result to `saveDelta`,
+		// which writes it next to cache; `load` must add such deltas to cache, and `save` (whole data) must drop them. Compaction is `load` and `save`.
+		virtual bool appendDelta() { return false; }
+		virtual void saveDelta(std::string, boost::any&) {} // Arguments: filename of existing cache, value from `merge` of new inputs
+
+		// Optional: memory held by result, so frontend can keep jobs under `--memory-limit` before resident size shows it.
+		virtual std::uintmax_t dataSize(boost::any&) { return 0; } // Arguments: value from `train`, `merge` or `load`; returns approximate size in bytes (0 if unknown)
+
+	private:
+		std::mutex countersMutex;
+		std::map<std::thread::id, std::map<std::string, double>> counters;
+		std::uint64_t baseSeed;
 	};
 
 // kate: indent-mode cstyle; indent-width 4; replace-tabs off; tab-width 4; 
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+
+// xoshiro256** (Blackman & Vigna): small state, no locking needed as every output owns its generator,
+// and the same sequence for the same seed everywhere (unlike std/boost distributions, which may change between versions).
+
+class generatorRandom {
+	public:
+		using result_type = std::uint64_t;
+
+		explicit generatorRandom(std::uint64_t seed = 0) { // State is filled by splitmix64, so any seed (even 0) is fine
+			for (auto& word: s) {
+				word = splitmix(seed);
+				}
+			}
+
+		static constexpr result_type min() { return 0; }
+		static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+		result_type operator()() {
+			const std::uint64_t result = rotl(s[1] * 5, 7) * 9;
+			const std::uint64_t t = s[1] << 17;
+			s[2] ^= s[0];
+			s[3] ^= s[1];
+			s[1] ^= s[2];
+			s[0] ^= s[3];
+			s[2] ^= t;
+			s[3] = rotl(s[3], 45);
+			return result;
+			}
+
+		std::uint64_t uniform(std::uint64_t n) { // In [0, n), n > 0; multiply-shift without bias (Lemire)
+			unsigned __int128 m = (unsigned __int128) (*this)() * n;
+			std::uint64_t low = m;
+			if (low < n) {
+				const std::uint64_t threshold = -n % n;
+				while (low < threshold) {
+					m = (unsigned __int128) (*this)() * n;
+					low = m;
+					}
+				}
+			return m >> 64;
+			}
+
+		double real() { return ((*this)() >> 11) * 0x1.0p-53; } // In [0, 1)
+
+		static std::uint64_t mix(std::uint64_t seed, std::uint64_t index) { // Seed of independent stream number `index`
+			std::uint64_t x = seed;
+			x = splitmix(x) ^ index;
+			return splitmix(x);
+			}
+
+	private:
+		static std::uint64_t rotl(std::uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+		static std::uint64_t splitmix(std::uint64_t& x) {
+			std::uint64_t z = (x += 0x9e3779b97f4a7c15);
+			z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+			z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+			return z ^ (z >> 31);
+			}
+
+		std::uint64_t s[4];
+	};
+
+// kate: indent-mode cstyle; indent-width 4; replace-tabs off; tab-width 4;
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Scoped spans for `--trace`. They are compiled in only with GENERATORS_TRACE defined (cmake option of the same name);
+// even then a span costs one branch until log is enabled. Usage: `TRACE_SPAN(trace, "markov.train");` at the beginning of scope.
+
+class traceLog { // Spans of all threads, every thread appends to its own buffer without locking
+	public:
+		struct span {
+			const char* name; // String literal: log is written while backend is still loaded
+			std::int64_t begin; // Nanoseconds of steady_clock
+			std::int64_t end;
+			};
+		struct threadBuffer {
+			std::thread::id thread;
+			std::vector<span> spans;
+			};
+
+		void enable() { on.store(true, std::memory_order_relaxed); }
+		void disable() { on.store(false, std::memory_order_relaxed); } // Spans already recorded stay
+		bool enabled() const { return on.load(std::memory_order_relaxed); }
+
+		threadBuffer& local() { // Buffer of calling thread, created on first use
+			thread_local std::vector<std::pair<const traceLog*, threadBuffer*>> known; // Frontend and backend have separate logs
+			for (auto const& entry: known) {
+				if (entry.first == this) {
+					return *entry.second;
+					}
+				}
+			std::lock_guard<std::mutex> lock(mutex);
+			buffers.push_back(std::make_unique<threadBuffer>());
+			buffers.back()->thread = std::this_thread::get_id();
+			known.emplace_back(this, buffers.back().get());
+			return *buffers.back();
+			}
+
+		std::vector<const threadBuffer*> threads() { // Only when no spans are being recorded (all jobs are finished)
+			std::lock_guard<std::mutex> lock(mutex);
+			std::vector<const threadBuffer*> res;
+			for (auto const& buffer: buffers) {
+				res.push_back(buffer.get());
+				}
+			return res;
+			}
+
+		static std::int64_t now() {
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+			}
+
+	private:
+		std::atomic<bool> on{false};
+		std::mutex mutex;
+		std::vector<std::unique_ptr<threadBuffer>> buffers;
+	};
+
+class traceSpan { // Records time from construction to destruction
+	public:
+		traceSpan(traceLog& log, const char* name):
+			buffer(log.enabled() ? &log.local() : nullptr),
+			name(name),
+			begin(buffer ? traceLog::now() : 0)
+			{ }
+		~traceSpan() {
+			if (buffer) {
+				buffer->spans.push_back({name, begin, traceLog::now()});
+				}
+			}
+		traceSpan(const traceSpan&) = delete;
+		traceSpan& operator=(const traceSpan&) = delete;
+
+	private:
+		traceLog::threadBuffer* buffer;
+		const char* name;
+		std::int64_t begin;
+	};
+
+#ifdef GENERATORS_TRACE
+#define TRACE_SPAN_NAME2(line) traceSpan_ ## line
+#define TRACE_SPAN_NAME(line) TRACE_SPAN_NAME2(line)
+#define TRACE_SPAN(log, name) traceSpan TRACE_SPAN_NAME(__LINE__)(log, name)
+#else
+#define TRACE_SPAN(log, name) ((void) 0)
+#endif
+
+// kate: indent-mode cstyle; indent-width 4; replace-tabs off; tab-width 4;
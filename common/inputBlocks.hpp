@@ -0,0 +1,69 @@
+#pragma once
+
+#include <generatorAPI.hpp>
+
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <functional>
+#include <boost/regex.hpp>
+
+// Helper for backends: pass input to `func` by blocks, each ending right after match of `bound` (or at the end of input).
+// Every block is searched for `bound` forward from its start, as backend goes through it, and is cut after the last match:
+// so blocks are split into the same matches (separators, lines, tokens) as whole input is, whatever pieces it is read by.
+// Mapped inputs are passed as is (no copying), streamed ones go through internal buffer.
+inline void readBlocks(generatorInput& input, const boost::regex& bound, std::function<void(const char*, const char*)> func) {
+	// Match ending right at the end of data is never taken: greedy one (`\n+` for example) may grow with more data.
+	// Text with no match in it is searched again only this far back, so match started before end of previous data is found whole.
+	const std::ptrdiff_t lookback = 1 << 16;
+	std::string carry;
+	std::size_t resume = 0; // Offset in carry where forward search goes on
+	std::string_view piece;
+	while (input.read(piece)) {
+		const char* begin = piece.data();
+		const char* end = begin + piece.size();
+		if (!carry.empty()) {
+			carry.append(piece);
+			begin = carry.data();
+			end = begin + carry.size();
+		}
+		if (input.eof()) { // Nothing will follow, so everything is passed, last match too
+			if (begin != end) {
+				func(begin, end);
+			}
+			return;
+		}
+		const char* from = begin + resume;
+		const char* cut = nullptr;
+		const char* growing = end; // Start of match that ends at `end`
+		boost::cregex_iterator it(from, end, bound, from == begin ? boost::match_default : boost::match_prev_avail), itEnd;
+		for (; it != itEnd; ++it) {
+			if ((*it)[0].second == end) {
+				growing = (*it)[0].first;
+				break;
+			}
+			cut = (*it)[0].second;
+		}
+		const char* last = cut ? cut : from;
+		const char* next = std::min(growing, end - last > lookback ? end - lookback : last);
+		if (cut == nullptr) { // Have to wait for more data
+			if (carry.empty()) {
+				carry.assign(begin, end);
+			}
+			resume = next - begin;
+			continue;
+		}
+		func(begin, cut);
+		if (carry.empty()) {
+			carry.assign(cut, end);
+		} else {
+			carry.erase(0, cut - begin);
+		}
+		resume = next - cut;
+	}
+	if (!carry.empty()) {
+		func(carry.data(), carry.data() + carry.size());
+	}
+}
+
+// kate: indent-mode cstyle; indent-width 4; replace-tabs off; tab-width 4; 
@@ -0,0 +1,242 @@
+#include "Decompress.hpp"
+
+#include <cstring>
+
+#ifdef GENERATORS_ZLIB
+#include <zlib.h>
+#endif
+#ifdef GENERATORS_ZSTD
+#include <zstd.h>
+#endif
+
+static const std::size_t readBlock = 1 << 20; // Compressed data is read by such pieces
+static const std::size_t queueDepth = 2; // Decompressed buffers waiting for consumer
+
+struct cancelled { }; // Thrown inside decompressing thread to stop it
+
+compression detectCompression(std::string const& fname) {
+	unsigned char magic[4] = {0, 0, 0, 0};
+	std::ifstream file(fname, std::ifstream::binary);
+	file.read(reinterpret_cast<char*>(magic), sizeof(magic));
+	if (file.gcount() >= 2 and magic[0] == 0x1f and magic[1] == 0x8b) {
+			return compression::gzip;
+			}
+	if (file.gcount() == 4 and magic[0] == 0x28 and magic[1] == 0xb5 and magic[2] == 0x2f and magic[3] == 0xfd) {
+			return compression::zstd;
+			}
+	return compression::none;
+	}
+
+compressedInput::compressedInput(std::string fname, compression format, std::uintmax_t fileSize, std::size_t bufsize):
+	fname(fname),
+	format(format),
+	fileSize(fileSize),
+	bufsize(bufsize)
+	{ }
+
+compressedInput::~compressedInput() {
+	stop();
+	}
+
+std::uintmax_t compressedInput::size() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return (done or (finished and ready.empty() and !error)) ? total : fileSize;
+	}
+
+bool compressedInput::eof() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return done or (finished and ready.empty() and !error); // Error is thrown by next `read`
+	}
+
+bool compressedInput::read(std::string_view& view) {
+	if (done) {
+			return false;
+			}
+	if (!thread.joinable()) {
+			thread = std::thread(&compressedInput::produce, this);
+			}
+	std::unique_lock<std::mutex> lock(mutex);
+	if (!current.empty()) { // Consumer is done with it
+			spare.push_back(std::move(current));
+			current = std::vector<char>();
+			}
+	cond.wait(lock, [this]() { return !ready.empty() or finished; });
+	if (ready.empty()) {
+			lock.unlock();
+			thread.join();
+			if (error) {
+					std::rethrow_exception(error);
+					}
+			done = true;
+			std::vector<std::vector<char>>().swap(spare);
+			return false;
+			}
+	current = std::move(ready.front());
+	ready.pop_front();
+	total += current.size();
+	cond.notify_all();
+	view = std::string_view(current.data(), current.size());
+	return true;
+	}
+
+void compressedInput::stop() {
+		{
+		std::lock_guard<std::mutex> lock(mutex);
+		cancel = true;
+		}
+	cond.notify_all();
+	if (thread.joinable()) {
+			thread.join();
+			}
+	}
+
+void compressedInput::rewind() {
+	stop();
+	ready.clear();
+	spare.clear();
+	current = std::vector<char>();
+	total = 0;
+	done = false;
+	finished = false;
+	cancel = false;
+	error = nullptr;
+	}
+
+std::vector<char> compressedInput::spareBuffer() {
+	std::vector<char> res;
+		{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!spare.empty()) {
+				res = std::move(spare.back());
+				spare.pop_back();
+				}
+		}
+	res.resize(bufsize);
+	return res;
+	}
+
+void compressedInput::push(std::vector<char>& piece) {
+		{
+		std::unique_lock<std::mutex> lock(mutex);
+		cond.wait(lock, [this]() { return ready.size() < queueDepth or cancel; });
+		if (cancel) {
+				throw cancelled();
+				}
+		ready.push_back(std::move(piece));
+		}
+	cond.notify_all();
+	piece = spareBuffer();
+	}
+
+void compressedInput::produce() {
+	try {
+			std::ifstream file;
+			file.exceptions(std::ifstream::badbit);
+			file.open(fname, std::ifstream::binary);
+			if (!file.is_open()) {
+					throw std::runtime_error("can't open `" + fname + "`");
+					}
+			std::vector<char> in(readBlock);
+			bool eofIn = false;
+			auto refill = [&file, &in, &eofIn]() -> std::size_t {
+				file.read(in.data(), in.size());
+				eofIn = file.gcount() == 0;
+				return file.gcount();
+				};
+			std::vector<char> out = spareBuffer();
+			std::size_t outLen = 0;
+			auto flush = [this, &out, &outLen]() {
+				out.resize(outLen);
+				push(out);
+				outLen = 0;
+				};
+
+			if (format == compression::gzip) {
+#ifdef GENERATORS_ZLIB
+					z_stream zs;
+					std::memset(&zs, 0, sizeof(zs));
+					if (inflateInit2(&zs, 15 + 32) != Z_OK) { // Accept gzip and zlib headers
+							throw std::runtime_error("can't initialise zlib");
+							}
+					std::unique_ptr<z_stream, int(*)(z_stream*)> guard(&zs, inflateEnd);
+					for (;;) {
+							if (zs.avail_in == 0 and !eofIn) {
+									zs.avail_in = refill();
+									zs.next_in = reinterpret_cast<Bytef*>(in.data());
+									}
+							zs.next_out = reinterpret_cast<Bytef*>(out.data() + outLen);
+							zs.avail_out = bufsize - outLen;
+							int ret = inflate(&zs, Z_NO_FLUSH);
+							outLen = bufsize - zs.avail_out;
+							if (outLen == bufsize) {
+									flush();
+									}
+							if (ret == Z_STREAM_END) { // Another member may follow (like `cat a.gz b.gz`)
+									if (zs.avail_in == 0 and !eofIn) {
+											zs.avail_in = refill();
+											zs.next_in = reinterpret_cast<Bytef*>(in.data());
+											}
+									if (zs.avail_in == 0) {
+											break;
+											}
+									inflateReset(&zs);
+									}
+							else if (ret == Z_BUF_ERROR and zs.avail_in == 0 and eofIn) {
+									throw std::runtime_error("unexpected end of gzip data in `" + fname + "`");
+									}
+							else if (ret != Z_OK and ret != Z_BUF_ERROR) {
+									throw std::runtime_error("broken gzip data in `" + fname + "`: " + (zs.msg ? zs.msg : "error " + std::to_string(ret)));
+									}
+							}
+#else
+					throw std::runtime_error("`" + fname + "` is gzip-compressed, but zlib support is not compiled in");
+#endif
+					}
+			else if (format == compression::zstd) {
+#ifdef GENERATORS_ZSTD
+					std::unique_ptr<ZSTD_DCtx, std::size_t(*)(ZSTD_DCtx*)> dctx(ZSTD_createDCtx(), ZSTD_freeDCtx);
+					ZSTD_inBuffer input = {in.data(), 0, 0};
+					std::size_t left = 0; // Non-zero if frame is not finished
+					bool full = false; // Decoder may have more even without input
+					for (;;) {
+							if (input.pos == input.size and !full) {
+									input = {in.data(), refill(), 0};
+									if (eofIn) {
+											break;
+											}
+									}
+							ZSTD_outBuffer output = {out.data(), bufsize, outLen};
+							left = ZSTD_decompressStream(dctx.get(), &output, &input);
+							if (ZSTD_isError(left)) {
+									throw std::runtime_error("broken zstd data in `" + fname + "`: " + ZSTD_getErrorName(left));
+									}
+							outLen = output.pos;
+							full = outLen == bufsize;
+							if (full) {
+									flush();
+									}
+							}
+					if (left != 0) {
+							throw std::runtime_error("unexpected end of zstd data in `" + fname + "`");
+							}
+#else
+					throw std::runtime_error("`" + fname + "` is zstd-compressed, but zstd support is not compiled in");
+#endif
+					}
+			if (outLen > 0) {
+					flush();
+					}
+			}
+	catch (cancelled&) {
+			}
+	catch (...) {
+			std::lock_guard<std::mutex> lock(mutex);
+			error = std::current_exception();
+			}
+		{
+		std::lock_guard<std::mutex> lock(mutex);
+		finished = true;
+		}
+	cond.notify_all();
+	}
+// kate: indent-mode cstyle; indent-width 4; replace-tabs off; tab-width 4;
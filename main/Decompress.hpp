@@ -0,0 +1,54 @@
+#ifndef I_V_DECOMPRESS
+#define I_V_DECOMPRESS
+#pragma once
+
+#include "mainDefs.hpp"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
+enum class compression { none, gzip, zstd };
+
+compression detectCompression(std::string const& fname); // By magic bytes
+
+// Compressed file, decompressed by separate thread while consumer parses previous pieces.
+// Size is size of compressed file until it is read to the end, then size of decompressed data.
+class compressedInput: public generatorInput {
+	public:
+		compressedInput(std::string fname, compression format, std::uintmax_t fileSize, std::size_t bufsize);
+		~compressedInput();
+
+		std::string name() { return fname; };
+		std::uintmax_t size();
+		bool read(std::string_view&);
+		bool eof();
+		void rewind();
+
+	private:
+		void stop();
+		void produce(); // Body of decompressing thread
+		void push(std::vector<char>& piece); // Called by it for every full buffer, waits if consumer is behind
+		std::vector<char> spareBuffer();
+
+		std::string fname;
+		compression format;
+		std::uintmax_t fileSize;
+		std::size_t bufsize;
+		std::uintmax_t total = 0;
+		bool done = false;
+		std::vector<char> current; // Given by last `read`
+
+		std::thread thread;
+		std::mutex mutex;
+		std::condition_variable cond;
+		std::deque<std::vector<char>> ready; // Decompressed, not given yet
+		std::vector<std::vector<char>> spare; // Already parsed, for reuse
+		bool finished = false; // Thread produced everything
+		bool cancel = false;
+		std::exception_ptr error;
+	};
+
+#endif
+// kate: indent-mode cstyle; indent-width 4; replace-tabs off; tab-width 4;
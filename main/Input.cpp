@@ -0,0 +1,146 @@
+#include "Input.hpp"
+#include "Decompress.hpp"
+#include <system_error>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace bip = boost::interprocess;
+
+mappedInput::mappedInput(std::string fname, std::uintmax_t begin, std::uintmax_t end, std::size_t bufsize):
+	fname(fname),
+	begin(begin),
+	length(end - begin),
+	bufsize(bufsize)
+	{ }
+
+bool mappedInput::read(std::string_view& view) {
+	if (fallback) {
+			return fallback->read(view);
+			}
+	if (done or length == 0) { // Empty mapping is error
+			rewind();
+			done = true;
+			return false;
+			}
+	try {
+			bip::file_mapping mapping(fname.c_str(), bip::read_only); // Region stays valid after file is closed
+			region = bip::mapped_region(mapping, bip::read_only, begin, length);
+			}
+	catch (bip::interprocess_exception&) { // Can't map it (special file, no address space), read it usual way
+			fallback = std::make_unique<streamInput>(fname, begin, begin + length, bufsize);
+			return fallback->read(view);
+			}
+	region.advise(bip::mapped_region::advice_sequential);
+	view = std::string_view(static_cast<const char*>(region.get_address()), length);
+	done = true;
+	return true;
+	}
+
+bool mappedInput::eof() {
+	return fallback ? fallback->eof() : done;
+	}
+
+void mappedInput::rewind() {
+	region = bip::mapped_region();
+	fallback.reset();
+	done = false;
+	}
+
+streamInput::streamInput(std::string fname, std::uintmax_t begin, std::uintmax_t end, std::size_t bufsize):
+	fname(fname),
+	begin(begin),
+	end(end),
+	pos(begin),
+	bufsize(bufsize)
+	{ }
+
+bool streamInput::read(std::string_view& view) {
+	if (pos == end) {
+			rewind();
+			pos = end;
+			return false;
+			}
+	if (!file.is_open()) {
+			file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+			file.open(fname, std::ifstream::binary);
+			file.seekg(pos);
+			buffer.resize(std::min<std::uintmax_t>(bufsize, end - begin));
+			}
+	std::size_t len = std::min<std::uintmax_t>(buffer.size(), end - pos);
+	file.read(buffer.data(), len);
+	pos += len;
+	view = std::string_view(buffer.data(), len);
+	return true;
+	}
+
+void streamInput::rewind() {
+	if (file.is_open()) {
+			file.close();
+			}
+	std::vector<char>().swap(buffer);
+	pos = begin;
+	}
+
+pipeInput::pipeInput(std::string fname, std::size_t bufsize):
+	fname(fname),
+	bufsize(bufsize)
+	{ }
+
+pipeInput::~pipeInput() {
+	if (fd > STDIN_FILENO) {
+			close(fd);
+			}
+	}
+
+bool pipeInput::read(std::string_view& view) {
+	if (done) {
+			return false;
+			}
+	if (fd < 0) {
+			fd = fname == "-" ? STDIN_FILENO : open(fname.c_str(), O_RDONLY);
+			if (fd < 0) {
+					throw std::system_error(errno, std::generic_category(), fname);
+					}
+			buffer.resize(bufsize);
+			}
+	ssize_t len;
+	do { // Returns as soon as something is available, not when buffer is full
+			len = ::read(fd, buffer.data(), buffer.size());
+			}
+	while (len < 0 and errno == EINTR);
+	if (len < 0) {
+			throw std::system_error(errno, std::generic_category(), name());
+			}
+	if (len == 0) {
+			done = true;
+			std::vector<char>().swap(buffer);
+			return false;
+			}
+	total += len;
+	view = std::string_view(buffer.data(), len);
+	return true;
+	}
+
+void pipeInput::rewind() {
+	throw std::logic_error("input `" + name() + "` can't be read twice");
+	}
+
+std::shared_ptr<generatorInput> openInput(std::string fname, std::uintmax_t begin, std::uintmax_t end, opts const& o) {
+	if (end - begin >= o.mmap_min and end - begin <= std::numeric_limits<std::size_t>::max() / 2) {
+			return std::make_shared<mappedInput>(fname, begin, end, o.buffer_size);
+			}
+	return std::make_shared<streamInput>(fname, begin, end, o.buffer_size);
+	}
+
+std::shared_ptr<generatorInput> openInput(std::string fname, opts const& o) {
+	if (fname == "-" or !boost::filesystem::is_regular_file(fname)) { // Size is unknown and it can't be reread
+			return std::make_shared<pipeInput>(fname, o.buffer_size);
+			}
+	compression format = detectCompression(fname);
+	if (format != compression::none) {
+			return std::make_shared<compressedInput>(fname, format, boost::filesystem::file_size(fname), o.buffer_size);
+			}
+	return openInput(fname, 0, boost::filesystem::file_size(fname), o);
+	}
+// kate: indent-mode cstyle; indent-width 4; replace-tabs off; tab-width 4; 
@@ -0,0 +1,80 @@
+#ifndef I_V_INPUT
+#define I_V_INPUT
+#pragma once
+
+#include "mainDefs.hpp"
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+// Inputs are opened lazily on first `read` and closed by `rewind` or destruction, so thousands of them can wait for their job.
+
+class streamInput;
+
+class mappedInput: public generatorInput { // Whole range at once, mapped read-only
+	public:
+		mappedInput(std::string fname, std::uintmax_t begin, std::uintmax_t end, std::size_t bufsize);
+
+		std::string name() { return fname; };
+		std::uintmax_t size() { return length; };
+		bool read(std::string_view&);
+		bool eof();
+		void rewind();
+
+	private:
+		std::string fname;
+		std::uintmax_t begin;
+		std::uintmax_t length;
+		std::size_t bufsize;
+		bool done = false;
+		boost::interprocess::mapped_region region;
+		std::unique_ptr<streamInput> fallback; // Set if file can't be mapped
+	};
+
+class streamInput: public generatorInput { // Range is read by pieces into buffer of fixed size
+	public:
+		streamInput(std::string fname, std::uintmax_t begin, std::uintmax_t end, std::size_t bufsize);
+
+		std::string name() { return fname; };
+		std::uintmax_t size() { return end - begin; };
+		bool read(std::string_view&);
+		bool eof() { return pos == end; };
+		void rewind();
+
+	private:
+		std::string fname;
+		std::uintmax_t begin;
+		std::uintmax_t end;
+		std::uintmax_t pos;
+		std::size_t bufsize;
+		std::ifstream file;
+		std::vector<char> buffer;
+	};
+
+class pipeInput: public generatorInput { // Stdin, pipe or other stream of unknown size, given piece by piece as bytes arrive
+	public:
+		pipeInput(std::string fname, std::size_t bufsize); // "-" is stdin
+		~pipeInput();
+
+		std::string name() { return fname == "-" ? "stdin" : fname; };
+		std::uintmax_t size() { return total; };
+		bool read(std::string_view&);
+		bool eof() { return done; };
+		void rewind();
+		bool rewindable() { return false; };
+
+	private:
+		std::string fname;
+		std::size_t bufsize;
+		int fd = -1;
+		std::uintmax_t total = 0;
+		bool done = false;
+		std::vector<char> buffer;
+	};
+
+// Choose suitable input for file range by its size, or by file type and content for whole file ("-" is stdin, compressed files are detected)
+std::shared_ptr<generatorInput> openInput(std::string fname, std::uintmax_t begin, std::uintmax_t end, opts const& o);
+std::shared_ptr<generatorInput> openInput(std::string fname, opts const& o);
+
+#endif
+// kate: indent-mode cstyle; indent-width 4; replace-tabs off; tab-width 4; 
@@ -1,69 +1,482 @@
 #include <generatorAPI.hpp>
 #include "mainDefs.hpp"
 #include "Parseopts.hpp"
+#include "Input.hpp"
+#include "Decompress.hpp"
+#include "Server.hpp"
+#include "Stats.hpp"
+
+#include <deque>
+#include <atomic>
 
 namespace dll = boost::dll;
 boost::shared_ptr<generatorAPI> backend;
+statsCollector stats;
+traceLog trace;
 
-void trainFile(std::shared_ptr<std::ifstream> file, std::string fname, std::vector<boost::any> *vec, std::mutex *mutex) {
-	std::cout << "Started parsing file " << fname << std::endl;
-	boost::any result = backend->train(file);
-	std::cout << "Finished parsing file " << fname << std::endl;
-	mutex->lock();
-	vec->push_back(result);
-	mutex->unlock();
+static double counterDiff(std::map<std::string, double>& before, std::map<std::string, double>& after, std::string name) {
+	return after[name] - before[name];
 	}
 
-std::vector<boost::any> trainAll(opts o) {
+struct trainJob {
+	std::uintmax_t size;
+	std::shared_ptr<generatorInput> input;
+	std::string name;
+	};
+
+struct trainResult { // Partial result with its size reported by backend
+	boost::any data;
+	std::uintmax_t size;
+	};
+
+struct trainResults { // Scheduler of train and merge jobs and results of finished ones, shared between them
 	std::mutex mutex;
-	std::vector<boost::any> vec;
+	std::vector<trainResult> vec;
+	double bytes = 0; // Known only after reading for streams
+	boost::asio::thread_pool *pool;
+	bool incremental; // Backend merges partial results, then they are merged by pairs as soon as possible
+	unsigned int slots; // Jobs allowed at one time
+	unsigned int running = 0; // Train and merge jobs started and not finished
+	std::deque<trainJob> pending; // Train jobs not started yet, largest first
+	std::uintmax_t memoryLimit = 0; // 0 = no limit
+	std::uintmax_t resultBytes = 0; // Sum of sizes of held results (including ones being merged)
+	std::uintmax_t growth = 0; // Expected growth of running train jobs
+	double ratio = 0; // Biggest size of result per byte of input seen yet, to predict growth
+	bool measured = false; // Some train job has finished, so ratio is known
+	bool warned = false;
+	std::exception_ptr error; // First failure of some job; no new jobs are started after it
+	};
+
+static void schedule(trainResults *res);
+
+static void jobFailed(trainResults *res, std::uintmax_t growth) { // Called from catch block of job
+	std::lock_guard<std::mutex> lock(res->mutex);
+	if (!res->error) {
+			res->error = std::current_exception();
+			}
+	res->pending.clear(); // Running jobs finish, and then pool is joined
+	res->growth -= growth;
+	--res->running;
+	}
+
+static std::uintmax_t memoryUsed(trainResults *res) { // Called with mutex locked
+	return std::max(residentMemory(), res->resultBytes) + res->growth;
+	}
+
+void mergePair(trainResult first, trainResult second, trainResults *res) {
+	TRACE_SPAN(trace, "merge job");
+	try {
+			phaseTimer timer(true);
+			std::vector<boost::any> pair;
+			pair.push_back(std::move(first.data));
+			pair.push_back(std::move(second.data));
+			boost::any result = backend->merge(pair);
+			pair.clear(); // Free partial results right now
+			std::uintmax_t size = res->memoryLimit ? backend->dataSize(result) : 0;
+			stats.addJob(makePhase("merge", timer));
+			std::lock_guard<std::mutex> lock(res->mutex);
+			res->resultBytes += size;
+			res->resultBytes -= first.size + second.size;
+			res->vec.push_back({std::move(result), size});
+			--res->running;
+			schedule(res);
+			}
+	catch (...) { // Exception can't leave pool thread
+			jobFailed(res, 0);
+			}
+	}
+
+void trainFile(std::shared_ptr<generatorInput> file, std::string fname, std::uintmax_t growth, trainResults *res) {
+	TRACE_SPAN(trace, "train job");
+	try {
+			std::cout << "Started parsing file " << fname << std::endl;
+			auto countersBefore = backend->getThreadCounters();
+			phaseTimer timer(true);
+			std::uintmax_t memoryBefore = res->memoryLimit ? residentMemory() : 0;
+			boost::any result = backend->train(file);
+			phaseStats job = makePhase("train " + fname, timer);
+			auto countersAfter = backend->getThreadCounters();
+			std::cout << "Finished parsing file " << fname << std::endl;
+			job.values["bytes"] = file->size();
+			job.values["tokens"] = counterDiff(countersBefore, countersAfter, "train.tokens");
+			if (job.wall > 0) {
+					job.values["bytes_per_s"] = job.values["bytes"] / job.wall;
+					job.values["tokens_per_s"] = job.values["tokens"] / job.wall;
+					}
+			std::uintmax_t size = res->memoryLimit ? backend->dataSize(result) : 0;
+			std::uintmax_t grown = size;
+			if (res->memoryLimit and size == 0) { // Backend does not know, so guess by resident memory (too much if other jobs grow too)
+					std::uintmax_t memoryAfter = residentMemory();
+					grown = memoryAfter > memoryBefore ? memoryAfter - memoryBefore : 0;
+					}
+			stats.addJob(job);
+			std::lock_guard<std::mutex> lock(res->mutex);
+			res->bytes += job.values["bytes"];
+			if (job.values["bytes"] > 0) {
+					res->ratio = std::max(res->ratio, grown / job.values["bytes"]);
+					}
+			res->measured = true;
+			res->resultBytes += size;
+			res->growth -= growth;
+			res->vec.push_back({std::move(result), size});
+			--res->running;
+			schedule(res);
+			}
+	catch (...) {
+			jobFailed(res, growth);
+			}
+	}
+
+static void schedule(trainResults *res) { // Start jobs while there are free slots and memory allows; called with mutex locked
+	if (res->error) {
+			return;
+			}
+	while (res->running < res->slots) {
+			if (res->incremental and res->vec.size() >= 2) { // Merges go first, they don't add new data
+					if (res->memoryLimit and res->running > 0 and memoryUsed(res) >= res->memoryLimit) { // Merge needs some room too, one at a time then
+							return;
+							}
+					trainResult second = std::move(res->vec.back());
+					res->vec.pop_back();
+					trainResult first = std::move(res->vec.back());
+					res->vec.pop_back();
+					++res->running;
+					boost::asio::post(*res->pool, [first = std::move(first), second = std::move(second), res]() mutable {
+						mergePair(std::move(first), std::move(second), res);
+						});
+					continue;
+					}
+			if (res->pending.empty()) {
+					return;
+					}
+			trainJob& job = res->pending.front();
+			std::uintmax_t growth = job.size == std::numeric_limits<std::uintmax_t>::max() ? 0 : job.size * res->ratio;
+			bool full = res->memoryLimit and (memoryUsed(res) + growth >= res->memoryLimit or !res->measured); // Growth is unknown until first job ends
+			if (full) {
+					if (res->running > 0) { // Wait for them, memory may be freed by merges
+							return;
+							}
+					if (!res->warned and res->measured) { // Nothing to wait for, so go on with one job at a time
+							std::cout << "Memory limit is reached, jobs are run one by one" << std::endl;
+							res->warned = true;
+							}
+					}
+			++res->running;
+			res->growth += growth;
+			boost::asio::post(*res->pool, boost::bind(trainFile, std::move(job.input), job.name, growth, res));
+			res->pending.pop_front();
+			}
+	}
+
+std::vector<std::streamoff> splitFile(std::string fname, std::streamoff size, opts const& o) { // Returns borders of chunks (first is 0, last is file size) or nothing if file should be parsed at once
+	std::vector<std::streamoff> res;
+	if (o.jobs < 2 or o.chunk_size == 0) {
+			return res;
+			}
+	std::streamoff parts = std::min<std::streamoff>(o.jobs, size / o.chunk_size);
+	if (parts < 2) {
+			return res;
+			}
+	TRACE_SPAN(trace, "split file");
+
+	std::ifstream file;
+	file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+	file.open(fname, std::ifstream::binary);
+	res.push_back(0);
+	std::string window;
+	for (std::streamoff i = 1; i < parts; ++i) {
+			std::streamoff target = std::max(size * i / parts, res.back());
+			std::string::size_type pos = std::string::npos;
+			window.clear();
+			// Look for block boundary after approximate border, but not further than one chunk
+			for (std::streamoff len = 1 << 16; pos == std::string::npos and window.size() < std::min<std::uintmax_t>(size - target, o.chunk_size); len *= 2) {
+					window.resize(std::min<std::streamoff>({len, size - target, (std::streamoff) o.chunk_size}));
+					file.seekg(target);
+					file.read(&window[0], window.size());
+					pos = backend->chunkBoundary(window);
+					}
+			if (pos == std::string::npos) {
+					if (res.size() == 1) { // Backend can't split it (or file has no boundaries at all)
+							break;
+							}
+					continue;
+					}
+			res.push_back(target + pos);
+			}
+	if (res.size() == 1) {
+			res.clear();
+			}
+	else {
+			res.push_back(size);
+			}
+	return res;
+	}
+
+std::vector<boost::any> trainAll(std::vector<std::shared_ptr<generatorInput>> inputs, opts const& o, double& bytes) { // Takes inputs over, each is released when its job ends
+	TRACE_SPAN(trace, "train");
+	trainResults res;
 	boost::asio::thread_pool pool(o.jobs);
+	res.pool = &pool;
+	res.incremental = backend->mergeIncremental();
+	res.slots = o.jobs;
+	res.memoryLimit = o.memory_limit;
 
-	for (auto const& file: o.inpfiles) {
-			boost::asio::post(pool, boost::bind(trainFile, file, o.inpfiles_names[file], &vec, &mutex));
+	std::vector<trainJob> jobs;
+	for (auto& file: inputs) {
+			std::string fname = file->name();
+			if (!file->rewindable()) { // Unknown size, so it may be the biggest one
+					jobs.push_back({std::numeric_limits<std::uintmax_t>::max(), std::move(file), fname});
+					continue;
+					}
+			if (dynamic_cast<compressedInput*>(file.get())) { // Can't be split
+					jobs.push_back({file->size(), std::move(file), fname});
+					continue;
+					}
+			auto borders = splitFile(fname, file->size(), o);
+			if (borders.empty()) {
+					jobs.push_back({file->size(), std::move(file), fname});
+					}
+			else {
+					std::cout << "Splitting file " << fname << " into " << borders.size() - 1 << " chunks" << std::endl;
+					for (size_t i = 1; i < borders.size(); ++i) {
+							std::string cname = fname + " [" + std::to_string(borders[i-1]) + ", " + std::to_string(borders[i]) + ")";
+							jobs.push_back({std::uintmax_t(borders[i] - borders[i-1]), openInput(fname, borders[i-1], borders[i], o), cname});
+							}
+					file.reset();
+					}
+			}
+	inputs.clear();
+	// Largest first, so one big file does not start last and leave other threads idle
+	std::stable_sort(jobs.begin(), jobs.end(), [](trainJob const& a, trainJob const& b) { return a.size > b.size; });
+		{
+		std::lock_guard<std::mutex> lock(res.mutex);
+		res.pending.assign(std::make_move_iterator(jobs.begin()), std::make_move_iterator(jobs.end()));
+		schedule(&res);
+		}
+	jobs.clear();
+	pool.join(); // Every finished job starts next ones, so this waits for all of them
+	if (res.error) {
+			std::rethrow_exception(res.error);
+			}
+	bytes = res.bytes;
+	std::vector<boost::any> results;
+	for (auto& result: res.vec) {
+			results.push_back(std::move(result.data));
+			}
+	return results;
+	}
+
+static std::atomic<unsigned long long> truncatedOuts(0); // Stopped by deadline or byte budget
+
+std::vector<std::string> outBlock(boost::any *data, unsigned long long first, unsigned long long count, opts const* o) {
+	TRACE_SPAN(trace, "out block");
+	std::vector<std::shared_ptr<std::ostringstream>> streams;
+	std::vector<std::shared_ptr<std::ostream>> outs;
+	for (unsigned long long i = 0; i < count; ++i) {
+			streams.push_back(std::make_shared<std::ostringstream>());
+			outs.push_back(streams.back());
 			}
-	pool.join(); // Wait for all jobs
-	return vec;
+	if (o->limited()) { // Every output gets own budget
+			for (unsigned long long i = 0; i < count; ++i) {
+					if (backend->outLimited(*data, *outs[i], backend->outputSeed(first + i), o->budget())) {
+							++truncatedOuts;
+							}
+					}
+			}
+	else {
+			backend->outBatch(*data, outs, first);
+			}
+	std::vector<std::string> res;
+	for (auto const& stream: streams) {
+			res.push_back(stream->str());
+			}
+	return res;
+	}
+
+void outAll(opts const& o, boost::any& data) { // Generate `o.count` outputs by blocks on `o.jobs` threads and write them in order
+	TRACE_SPAN(trace, "out");
+	const unsigned long long blockSize = 64;
+	unsigned int threads = backend->outConcurrent() ? o.jobs : 1;
+	boost::asio::thread_pool pool(threads);
+	// Blocks wait for writing in memory, so only few of them are made ahead: next one is posted when one is written
+	const std::size_t inFlight = 2 * threads;
+	std::deque<std::future<std::vector<std::string>>> blocks;
+	unsigned long long posted = 0;
+	auto postBlock = [&]() {
+			auto task = std::make_shared<std::packaged_task<std::vector<std::string>()>>(boost::bind(outBlock, &data, posted, std::min(blockSize, o.count - posted), &o));
+			blocks.push_back(task->get_future());
+			boost::asio::post(pool, [task]() { (*task)(); });
+			posted += std::min(blockSize, o.count - posted);
+			};
+	while (posted < o.count and blocks.size() < inFlight) {
+			postBlock();
+			}
+	bool first = true;
+	while (!blocks.empty()) {
+			std::vector<std::string> block = blocks.front().get();
+			blocks.pop_front();
+			if (posted < o.count) {
+					postBlock();
+					}
+			for (auto const& str: block) {
+					if (!first) {
+							(*o.out) << o.delimiter;
+							}
+					(*o.out) << str;
+					first = false;
+					}
+			}
+	pool.join();
+	}
+
+void writeReports(opts const& o) { // Statistics and trace, if asked
+	if (!o.stats.empty()) {
+			stats.write(o.stats, backend->getCounters());
+			}
+	if (!o.trace.empty()) {
+			writeTrace(o.trace, {{&trace, "frontend"}, {&backend->trace, "backend"}});
+			}
+	}
+
+void finish(opts const& o) { // Write reports and exit
+	if (o.memory_limit) {
+			stats.printMemory(std::cout);
+			}
+	writeReports(o);
+	exit(EXIT_SUCCESS);
 	}
 
 int main(int ac, char* av[]) {
 	try {
 			opts o = parseOpts(ac, av);
 			std::cout << "Parsing options finished" << std::endl;
-			backend = dll::import_alias<generatorAPI>(o.backend, "backendInterface", dll::load_mode::default_mode);
+			if (!o.stats.empty() or o.memory_limit) {
+					stats.watchMemory();
+					}
+			if (!o.trace.empty()) {
+					trace.enable();
+					}
+				{
+				TRACE_SPAN(trace, "backend_load");
+				phaseTimer timer;
+				backend = dll::import_alias<generatorAPI>(o.backend, "backendInterface", dll::load_mode::default_mode);
+				stats.add(makePhase("backend_load", timer));
+				}
 			std::cout << "Backend loaded" << std::endl;
-			backend->init(o.backend_opts);
+			if (!o.trace.empty()) {
+					backend->trace.enable();
+					}
+			backend->setSeed(o.seed);
+				{
+				TRACE_SPAN(trace, "init");
+				phaseTimer timer;
+				backend->init(o.backend_opts);
+				stats.add(makePhase("init", timer));
+				}
 			std::cout << "Backend successfully initialisated" << std::endl;
 
 			boost::any backendData;
 
-			bool loadcache = o.cache.value == "r" or (o.cache.value == "a" and boost::filesystem::exists(o.cachefile));
-			if (loadcache) { // If file does not exist, append acts like write
+			// If file does not exist, append acts like write; if backend appends by delta, cache is not loaded at all
+			bool delta = o.cache.value == "a" and boost::filesystem::exists(o.cachefile) and backend->appendDelta();
+			bool loadcache = o.cache.value == "r" or o.cache.value == "c" or (o.cache.value == "a" and boost::filesystem::exists(o.cachefile) and !delta);
+			if (loadcache) {
+					TRACE_SPAN(trace, "load");
+					phaseTimer timer;
 					backendData = backend->load(o.cachefile);
+					stats.add(makePhase("load", timer));
 					std::cout << "Cache loaded " << std::endl;
 					}
 
-			if (o.cache.value != "r") {
-					backend->trainBegin(o.inpfiles); // Notify backend
-					auto trainRes = trainAll(o);
+			if (o.cache.value != "r" and o.cache.value != "c") {
+						{
+						TRACE_SPAN(trace, "trainBegin");
+						phaseTimer timer;
+						backend->trainBegin(o.inpfiles); // Notify backend
+						stats.add(makePhase("trainBegin", timer));
+						}
+					double bytes = 0;
+					phaseTimer timer;
+					auto countersBefore = backend->getCounters();
+					auto trainRes = trainAll(std::move(o.inpfiles), o, bytes);
+					phaseStats train = makePhase("train", timer);
+					auto countersAfter = backend->getCounters();
+					train.values["tokens"] = counterDiff(countersBefore, countersAfter, "train.tokens");
+					train.values["bytes"] = bytes;
+					if (train.wall > 0) {
+							train.values["bytes_per_s"] = train.values["bytes"] / train.wall;
+							train.values["tokens_per_s"] = train.values["tokens"] / train.wall;
+							}
+					stats.add(train);
 					if (loadcache) { // Add preloaded data
-							trainRes.push_back(backendData);
+							trainRes.push_back(std::move(backendData));
 							}
-					backendData = backend->merge(trainRes);
+						{
+						TRACE_SPAN(trace, "merge");
+						phaseTimer mergeTimer;
+						backendData = backend->merge(trainRes);
+						stats.add(makePhase("merge", mergeTimer));
+						}
 					std::cout << "Training finished successfully" << std::endl;
 					}
 
-			if (o.cache.value == "w" or o.cache.value == "a") {
-					backend->save(o.cachefile, backendData);
-					std::cout << "Cache saved, exiting..." << std::endl;
-					exit(EXIT_SUCCESS);
+			if (o.cache.value == "w" or o.cache.value == "a" or o.cache.value == "c") {
+						{
+						TRACE_SPAN(trace, "save");
+						phaseTimer timer;
+						if (delta) {
+								backend->saveDelta(o.cachefile, backendData);
+								}
+						else {
+								backend->save(o.cachefile, backendData);
+								}
+						stats.add(makePhase("save", timer));
+						}
+					std::cout << (delta ? "Delta of cache saved, exiting..." : "Cache saved, exiting...") << std::endl;
+					finish(o);
+					}
+
+			if (!o.serve.empty()) {
+					writeReports(o); // Server never exits by itself
+					// Trace covers startup only: spans of requests would never be written, and log of long-running server would grow without end
+					trace.disable();
+					backend->trace.disable();
+					serve(o, *backend, backendData);
 					}
 
-			std::cout << "Ready to out, starting it..." << std::endl;
-			backend->out(backendData, o.out);
+			std::cout << "Ready to out (seed " << o.seed << "), starting it..." << std::endl;
+			phaseTimer timer;
+			auto countersBefore = backend->getCounters();
+			if (o.count == 1 and o.limited()) {
+					TRACE_SPAN(trace, "out");
+					if (backend->outLimited(backendData, *o.out, backend->outputSeed(0), o.budget())) {
+							++truncatedOuts;
+							}
+					}
+			else if (o.count == 1) {
+					TRACE_SPAN(trace, "out");
+					backend->out(backendData, o.out);
+					}
+			else {
+					outAll(o, backendData);
+					}
+			phaseStats out = makePhase("out", timer);
+			auto countersAfter = backend->getCounters();
+			out.values["outputs"] = o.count;
+			if (o.limited()) {
+					out.values["truncated"] = truncatedOuts;
+					}
+			out.values["tokens"] = counterDiff(countersBefore, countersAfter, "out.tokens");
+			if (out.values["tokens"] > 0) {
+					out.values["ns_per_token"] = out.wall * 1e9 / out.values["tokens"];
+					}
+			stats.add(out);
 			if (!o.no_end) { (*o.out) << std::endl; };
+			if (truncatedOuts > 0) {
+					std::cout << truncatedOuts << " of " << o.count << " outputs truncated by deadline or byte budget" << std::endl;
+					}
 			std::cout << "Out finished, exiting..." << std::endl;
-			exit(EXIT_SUCCESS);
+			finish(o);
 			}
 	catch (std::exception &e) {
 			std::cerr << "Error in main code: " << e.what() << "\n";
@@ -1,6 +1,9 @@
 #include "mainDefs.hpp"
 #include "Parseopts.hpp"
+#include "Input.hpp"
 #include <boost/program_options.hpp>
+#include <unistd.h>
+#include <random>
 
 namespace po = boost::program_options;
 
@@ -12,7 +15,7 @@ void validate(boost::any& v, std::vector<std::string> const &values, cacheop*, i
 	// Extract the first string from 'values'. If there is more than
 	// one string, it's an error, and exception will be thrown.
 	std::string const& s = validators::get_single_string(values);
-	std::vector<std::string> allowed {"r", "w", "a", ""};
+	std::vector<std::string> allowed {"r", "w", "a", "c", ""};
 	std::vector<std::string>::iterator it = find(allowed.begin(), allowed.end(), s);
 
 	if (it != allowed.end()) {
@@ -23,12 +26,88 @@ void validate(boost::any& v, std::vector<std::string> const &values, cacheop*, i
 			}
 	}
 
+static std::uintmax_t parseSize(std::string const& str) { // Bytes with optional suffix K, M or G (binary)
+	std::size_t pos = 0;
+	std::uintmax_t res = std::stoull(str, &pos);
+	std::string suffix = str.substr(pos);
+	if (suffix == "K" or suffix == "k") {
+			res <<= 10;
+			}
+	else if (suffix == "M" or suffix == "m") {
+			res <<= 20;
+			}
+	else if (suffix == "G" or suffix == "g") {
+			res <<= 30;
+			}
+	else if (!suffix.empty()) {
+			throw std::invalid_argument("bad size `" + str + "`");
+			}
+	return res;
+	}
+
+static std::string unescape(std::string str) { // Only simple escapes, for delimiters
+	std::string res;
+	for (auto it = str.begin(); it != str.end(); ++it) {
+			if (*it == '\\' and it + 1 != str.end()) {
+					switch (*++it) {
+							case 'n': res += '\n'; break;
+							case 't': res += '\t'; break;
+							case 'r': res += '\r'; break;
+							case '0': res += '\0'; break;
+							case '\\': res += '\\'; break;
+							default: throw std::invalid_argument("unknown escape sequence in `"+str+"`");
+							}
+					}
+			else {
+					res += *it;
+					}
+			}
+	return res;
+	}
+
 static void checkFile(std::string fname) {
 	if (!boost::filesystem::exists(fname)) {
 			throw std::invalid_argument("file `"+fname+"` not found.");
 			}
 	}
 
+static void addInput(std::string fname, opts& o) { // Regular file, or every regular file under directory
+	namespace fs = boost::filesystem;
+	if (fname == "-") {
+			o.inpfiles.push_back(openInput(fname, o));
+			return;
+			}
+	checkFile(fname);
+	if (fs::is_directory(fname)) {
+			for (auto const& ent: fs::recursive_directory_iterator(fname)) {
+					if (fs::is_regular_file(ent.status())) {
+							o.inpfiles.push_back(openInput(ent.path().string(), o));
+							}
+					}
+			}
+	else {
+			o.inpfiles.push_back(openInput(fname, o));
+			}
+	}
+
+static void addManifest(std::string fname, opts& o) { // One path per line, relative ones are relative to manifest
+	namespace fs = boost::filesystem;
+	checkFile(fname);
+	std::ifstream manifest(fname);
+	fs::path dir = fs::path(fname).parent_path();
+	std::string line;
+	while (std::getline(manifest, line)) {
+			if (!line.empty() and line.back() == '\r') {
+					line.pop_back();
+					}
+			if (line.empty() or line[0] == '#') {
+					continue;
+					}
+			fs::path path(line);
+			addInput((path.is_absolute() ? path : dir / path).string(), o);
+			}
+	}
+
 struct opts parseOpts(int ac, char* av[]) {
 	struct opts o;
 	try {
@@ -38,11 +117,24 @@ struct opts parseOpts(int ac, char* av[]) {
 			generic.add_options()
 			("output,o", po::value< std::string >(), "output file")
 			("no-end", "do not write '\\n' at the end")
+			("count,n", po::value<unsigned long long>()->default_value(1), "count of outputs to generate from one model (uses --jobs threads if backend allows)")
+			("seed,s", po::value<std::uint64_t>(), "seed for random generation: same seed gives same outputs (random by default)")
+			("deadline", po::value<double>(), "stop every output at token boundary after this many milliseconds (it is reported as truncated)")
+			("max-bytes", po::value<std::string>(), "stop every output at token boundary before it exceeds this size, in bytes (suffixes K, M, G allowed)")
+			("delimiter,d", po::value<std::string>()->default_value("\\n"), "delimiter written between outputs (escapes \\n, \\t, \\r, \\0 and \\\\ are allowed)")
 			("backend,b", po::value<std::string>()->required(), "REQUIRED path to backend")
 			("backend-opts,p", po::value<std::vector<std::string>>()->default_value(std::vector<std::string>(), "empty"), "parametrs to backend (can be used multiplie times)")
-			("jobs,j", po::value<unsigned int>()->default_value(1), "maximal count of jobs at one time (1 per file) (1 by default)")
-			("cache,c", po::value <cacheop>()->default_value(cacheop(""), "empty"), "cache operation (r=read, w=write, a=append, no option=do not use caching) requires --cache-file")
+			("jobs,j", po::value<unsigned int>()->default_value(1), "maximal count of jobs at one time (1 per file or file chunk) (1 by default)")
+			("chunk-size", po::value<std::uintmax_t>()->default_value(4 << 20), "minimal size of chunk when splitting big file between jobs, in bytes (0=never split)")
+			("mmap-min", po::value<std::uintmax_t>()->default_value(16 << 20), "map input files (chunks) of this size and bigger into memory, read smaller ones by buffer")
+			("buffer-size", po::value<std::size_t>()->default_value(16 << 20), "size of read buffer for inputs that are not mapped, in bytes")
+			("memory-limit", po::value<std::string>(), "hold back new train and merge jobs while resident memory or model size reported by backend nears this, in bytes (suffixes K, M, G allowed)")
+			("cache,c", po::value <cacheop>()->default_value(cacheop(""), "empty"), "cache operation (r=read, w=write, a=append, c=compact: fold appended deltas into cache, no option=do not use caching) requires --cache-file")
 			("cache-file,f", po::value <std::string>()->default_value(""), "cache file to use (or another way to determine cache, like table name, optional)")
+			("serve", po::value<std::string>(), "instead of one output, stay resident and answer requests on this unix socket (see README)")
+			("manifest,m", po::value<std::vector<std::string>>(), "file with list of inputs, one path per line (can be used multiplie times)")
+			("stats", po::value<std::string>(), "write timing and throughput statistics of all phases to this file (JSON)")
+			("trace", po::value<std::string>(), "record spans of frontend and backend work and write them to this file (Chrome trace JSON, open in chrome://tracing or Perfetto)")
 			("help,h", "print help message")
 			("version,v", "print version string");
 			po::options_description hidden("Hidden options");
@@ -63,7 +155,7 @@ struct opts parseOpts(int ac, char* av[]) {
 
 			if (vm.count("help")) {
 					std::cout << "This is generators frontend part - applictation for generating new sequence based on your own. You need backend part to use." << std::endl;
-					std::cout << "Usage: " << boost::filesystem::basename(av[0]) << " -b BACKEND [options] [INPUT_FILES]..." << std::endl;
+					std::cout << "Usage: " << boost::filesystem::basename(av[0]) << " -b BACKEND [options] [INPUT_FILES_OR_DIRECTORIES]..." << std::endl;
 					std::cout << generic << std::endl;
 					exit(EXIT_SUCCESS);
 					}
@@ -86,30 +178,83 @@ struct opts parseOpts(int ac, char* av[]) {
 					o.out = std::shared_ptr<std::ostream>(&std::cout, [](void*) {});
 					}
 			o.no_end = vm.count("no-end") ? true : false;
+			o.count = vm["count"].as<unsigned long long>();
+			if (o.count == 0) {
+					throw std::invalid_argument("count of outputs can't be zero");
+					}
+			o.seed = vm.count("seed") ? vm["seed"].as<std::uint64_t>() : (std::uint64_t(std::random_device()()) << 32 | std::random_device()());
+			if (vm.count("deadline")) {
+					o.deadline = vm["deadline"].as<double>();
+					if (o.deadline <= 0) {
+							throw std::invalid_argument("deadline must be positive");
+							}
+					}
+			if (vm.count("max-bytes")) {
+					o.max_bytes = parseSize(vm["max-bytes"].as<std::string>());
+					if (o.max_bytes == 0) {
+							throw std::invalid_argument("byte budget can't be zero");
+							}
+					}
+			o.delimiter = unescape(vm["delimiter"].as<std::string>());
 			o.backend = vm["backend"].as<std::string>();
 			checkFile(o.backend);
 			o.backend_opts = vm["backend-opts"].as<std::vector <std::string> >();
 			o.jobs = vm["jobs"].as<unsigned int>();
+			o.chunk_size = vm["chunk-size"].as<std::uintmax_t>();
+			o.mmap_min = vm["mmap-min"].as<std::uintmax_t>();
+			o.buffer_size = vm["buffer-size"].as<std::size_t>();
+			if (o.buffer_size == 0) {
+					throw std::invalid_argument("buffer size can't be zero");
+					}
+			if (vm.count("memory-limit")) {
+					o.memory_limit = parseSize(vm["memory-limit"].as<std::string>());
+					}
 			cacheop cop = vm["cache"].as<cacheop>();
 			o.cache = cop;
 			o.cachefile = vm["cache-file"].as<std::string>();
+			if (vm.count("stats")) {
+					o.stats = vm["stats"].as<std::string>();
+					}
+			if (vm.count("trace")) {
+#ifdef GENERATORS_TRACE
+					o.trace = vm["trace"].as<std::string>();
+#else
+					throw std::invalid_argument("tracing is not compiled in (GENERATORS_TRACE cmake option)");
+#endif
+					}
+			if (vm.count("serve")) {
+					o.serve = vm["serve"].as<std::string>();
+					if (cop.value == "w" or cop.value == "a" or cop.value == "c") {
+							throw std::invalid_argument("you can't serve when writing cache");
+							}
+					}
 
-			if (!vm.count("input-files") and cop.value != "r") { // Make fancy message
-					throw std::invalid_argument("you must specify input files");
+			bool inputs = vm.count("input-files") or vm.count("manifest");
+			bool reading = cop.value == "r" or cop.value == "c"; // Only from cache
+			if (!inputs and !reading) { // Read stdin unless it is terminal
+					if (isatty(STDIN_FILENO)) { // Make fancy message
+							throw std::invalid_argument("you must specify input files");
+							}
+					addInput("-", o);
 					}
-			else if (vm.count("input-files") and cop.value == "r") {
+			else if (inputs and reading) {
 					throw std::invalid_argument("you don't need to set input files if you read from cache");
 					}
-			else if (cop.value == "r") {
+			else if (reading) {
 					}
 			else {
-					for (auto const& fname: vm["input-files"].as<std::vector<std::string> >()) {
-							checkFile(fname);
-							auto ptr = std::make_shared<std::ifstream>();
-							ptr->exceptions(std::ifstream::failbit | std::ifstream::badbit);
-							ptr->open(fname);
-							o.inpfiles.push_back(ptr);
-							o.inpfiles_names[ptr] = fname;
+					if (vm.count("input-files")) {
+							for (auto const& fname: vm["input-files"].as<std::vector<std::string> >()) {
+									addInput(fname, o);
+									}
+							}
+					if (vm.count("manifest")) {
+							for (auto const& fname: vm["manifest"].as<std::vector<std::string> >()) {
+									addManifest(fname, o);
+									}
+							}
+					if (o.inpfiles.empty()) {
+							throw std::invalid_argument("no input files found");
 							}
 					}
 			return o;
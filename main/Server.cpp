@@ -0,0 +1,146 @@
+#include "Server.hpp"
+
+#include <atomic>
+#include <future>
+#include <thread>
+#include <boost/endian/conversion.hpp>
+
+namespace local = boost::asio::local;
+
+static const std::uint32_t maxRequest = 1 << 20;
+
+static std::atomic<std::uint64_t> requests(0); // Numbers outputs, so every request has own seed
+
+static void writeFrame(local::stream_protocol::socket& sock, std::string const& payload) {
+	std::uint32_t len = boost::endian::native_to_big<std::uint32_t>(payload.size());
+	std::vector<boost::asio::const_buffer> frame = {boost::asio::buffer(&len, sizeof(len)), boost::asio::buffer(payload)};
+	boost::asio::write(sock, frame);
+	}
+
+struct clientRequest { // Parsed request payload: words separated by spaces
+	bool stream = false; // Send text by pieces
+	bool status = false; // Send "complete" or "truncated" frame after text
+	outBudget budget;
+	};
+
+static clientRequest parseRequest(std::string const& payload, opts const& o) {
+	clientRequest res;
+	res.budget = o.budget(); // Defaults from command line, words below override them
+	std::istringstream words(payload);
+	std::string word;
+	while (words >> word) {
+			if (word == "stream") {
+					res.stream = true;
+					}
+			else if (word == "status") {
+					res.status = true;
+					}
+			else if (word.compare(0, 9, "deadline=") == 0) {
+					res.budget.deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::milli>(std::stod(word.substr(9))));
+					}
+			else if (word.compare(0, 6, "bytes=") == 0) {
+					res.budget.bytes = std::stoull(word.substr(6));
+					}
+			else {
+					throw std::invalid_argument("unknown request word `" + word + "`");
+					}
+			}
+	return res;
+	}
+
+static bool generate(generatorAPI& backend, boost::any& data, clientRequest const& req, local::stream_protocol::socket& sock) { // Returns true if output was truncated
+	std::uint64_t index = requests++;
+	if (!req.budget.limited()) {
+			auto stream = std::make_shared<std::ostringstream>();
+			std::vector<std::shared_ptr<std::ostream>> outs = {stream};
+			backend.outBatch(data, outs, index);
+			writeFrame(sock, stream->str());
+			return false;
+			}
+	std::ostringstream stream;
+	bool truncated = backend.outLimited(data, stream, backend.outputSeed(index), req.budget);
+	writeFrame(sock, stream.str());
+	return truncated;
+	}
+
+static bool generateStream(generatorAPI& backend, boost::any& data, clientRequest const& req, local::stream_protocol::socket& sock) { // Frame per piece as soon as it is ready, empty frame at the end
+	auto state = backend.outBegin(data, backend.outputSeed(requests++));
+	std::string piece;
+	std::uintmax_t written = 0;
+	bool truncated = false;
+	for (;;) {
+			if (req.budget.expired()) {
+					truncated = true;
+					break;
+					}
+			if (!backend.outNext(*state, piece)) {
+					break;
+					}
+			if (!req.budget.fits(written, piece.size())) {
+					truncated = true;
+					break;
+					}
+			if (!piece.empty()) {
+					writeFrame(sock, piece);
+					written += piece.size();
+					}
+			}
+	writeFrame(sock, "");
+	return truncated;
+	}
+
+// Runs on own thread for whole connection; only generation is posted to `pool`, so idle client holds no worker
+static void serveClient(std::shared_ptr<local::stream_protocol::socket> sock, generatorAPI* backend, boost::any* data, std::mutex* mutex, boost::asio::thread_pool* pool, opts const* o) {
+	try {
+			for (;;) {
+					std::uint32_t len;
+					boost::asio::read(*sock, boost::asio::buffer(&len, sizeof(len)));
+					len = boost::endian::big_to_native(len);
+					if (len > maxRequest) {
+							throw std::invalid_argument("too long request");
+							}
+					std::string request(len, '\0');
+					boost::asio::read(*sock, boost::asio::buffer(&request[0], len));
+
+					clientRequest req = parseRequest(request, *o); // Before queue: deadline counts from arrival, waiting included
+
+					auto task = std::make_shared<std::packaged_task<void()>>([sock, backend, data, mutex, req]() {
+							std::unique_lock<std::mutex> lock;
+							if (mutex != nullptr) {
+									lock = std::unique_lock<std::mutex>(*mutex);
+									}
+							bool truncated = req.stream ? generateStream(*backend, *data, req, *sock) : generate(*backend, *data, req, *sock);
+							if (req.status) {
+									writeFrame(*sock, truncated ? "truncated" : "complete");
+									}
+							});
+					std::future<void> done = task->get_future();
+					boost::asio::post(*pool, [task]() { (*task)(); });
+					done.get(); // Errors of generation and writing come here
+					}
+			}
+	catch (boost::system::system_error& e) {
+			if (e.code() != boost::asio::error::eof) {
+					std::cerr << "Client connection error: " << e.what() << std::endl;
+					}
+			}
+	catch (std::exception& e) {
+			std::cerr << "Error while serving client: " << e.what() << std::endl;
+			}
+	}
+
+void serve(opts const& o, generatorAPI& backend, boost::any& data) {
+	boost::asio::io_context io;
+	boost::filesystem::remove(o.serve); // Socket left from previous run
+	local::stream_protocol::acceptor acceptor(io, local::stream_protocol::endpoint(o.serve));
+	boost::asio::thread_pool pool(o.jobs);
+	std::mutex mutex; // Only for backends that can't generate from several threads
+	std::mutex* outMutex = backend.outConcurrent() ? nullptr : &mutex;
+	std::cout << "Serving on " << o.serve << " with " << o.jobs << " workers" << std::endl;
+	for (;;) {
+			auto sock = std::make_shared<local::stream_protocol::socket>(io);
+			acceptor.accept(*sock);
+			std::thread(serveClient, sock, &backend, &data, outMutex, &pool, &o).detach(); // Everything it uses lives until exit
+			}
+	}
+// kate: indent-mode cstyle; indent-width 4; replace-tabs off; tab-width 4; 
@@ -0,0 +1,16 @@
+#ifndef I_V_SERVER
+#define I_V_SERVER
+#pragma once
+
+#include "mainDefs.hpp"
+
+// Resident mode: answer generation requests on unix socket `o.serve`, never returns. Every connection is read by own thread,
+// requests are generated by `o.jobs` workers, so idle connections don't hold them.
+// Protocol: every frame is 4-byte big-endian length and payload. For every request frame server sends one frame with
+// generated text, or (if payload has word "stream") frame per piece and empty frame at the end. Words "deadline=MS" and "bytes=N"
+// override `--deadline`/`--max-bytes` for the request, word "status" adds frame "complete" or "truncated" after text.
+// Connection may be used for many requests.
+void serve(opts const& o, generatorAPI& backend, boost::any& data);
+
+#endif
+// kate: indent-mode cstyle; indent-width 4; replace-tabs off; tab-width 4; 
@@ -0,0 +1,186 @@
+#include "Stats.hpp"
+
+#include <iomanip>
+#include <unistd.h>
+
+static const std::chrono::milliseconds samplePeriod(10);
+
+phaseTimer::phaseTimer(bool thread):
+	thread(thread),
+	wallStart(std::chrono::steady_clock::now()),
+	cpuStart(cpuNow())
+	{ }
+
+double phaseTimer::cpuNow() {
+	timespec ts;
+	clock_gettime(thread ? CLOCK_THREAD_CPUTIME_ID : CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+	}
+
+double phaseTimer::wall() {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+	}
+
+double phaseTimer::cpu() {
+	return cpuNow() - cpuStart;
+	}
+
+phaseStats makePhase(std::string name, phaseTimer& timer) {
+	phaseStats res;
+	res.name = name;
+	res.wall = timer.wall();
+	res.cpu = timer.cpu();
+	return res;
+	}
+
+std::uintmax_t residentMemory() {
+	std::ifstream statm("/proc/self/statm");
+	std::uintmax_t total = 0, resident = 0;
+	if (!(statm >> total >> resident)) {
+			return 0;
+			}
+	return resident * sysconf(_SC_PAGESIZE);
+	}
+
+statsCollector::~statsCollector() {
+		{
+		std::lock_guard<std::mutex> lock(mutex);
+		samplerStop = true;
+		}
+	samplerCond.notify_all();
+	if (sampler.joinable()) {
+			sampler.join();
+			}
+	}
+
+void statsCollector::watchMemory() {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!sampler.joinable()) {
+			peak = residentMemory();
+			sampler = std::thread(&statsCollector::sampleMemory, this);
+			}
+	}
+
+void statsCollector::sampleMemory() {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (!samplerCond.wait_for(lock, samplePeriod, [this]() { return samplerStop; })) {
+			lock.unlock();
+			std::uintmax_t now = residentMemory();
+			lock.lock();
+			peak = std::max(peak, now);
+			}
+	}
+
+void statsCollector::add(phaseStats phase) {
+	std::uintmax_t now = residentMemory();
+	std::lock_guard<std::mutex> lock(mutex);
+	if (sampler.joinable()) {
+			phase.values["peak_rss_bytes"] = std::max(peak, now);
+			peak = now; // Next phase starts from here
+			}
+	phases.push_back(phase);
+	}
+
+void statsCollector::printMemory(std::ostream& o) {
+	std::lock_guard<std::mutex> lock(mutex);
+	std::ostringstream line;
+	line << "Peak resident memory:" << std::fixed << std::setprecision(1);
+	for (auto const& phase: phases) {
+			auto it = phase.values.find("peak_rss_bytes");
+			if (it != phase.values.end()) {
+					line << " " << phase.name << " " << it->second / (1 << 20) << " MiB";
+					}
+			}
+	o << line.str() << std::endl;
+	}
+
+void statsCollector::addJob(phaseStats job) {
+	std::lock_guard<std::mutex> lock(mutex);
+	jobs.push_back(job);
+	}
+
+static std::string jsonString(std::string const& str) {
+	std::ostringstream res;
+	res << '"';
+	for (unsigned char c: str) {
+			if (c == '"' or c == '\\') {
+					res << '\\' << c;
+					}
+			else if (c < 0x20) {
+					res << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int) c << std::dec;
+					}
+			else {
+					res << c;
+					}
+			}
+	res << '"';
+	return res.str();
+	}
+
+static void writePhase(std::ostream& file, phaseStats const& phase) {
+	file << "{\"name\": " << jsonString(phase.name) << ", \"wall_s\": " << phase.wall << ", \"cpu_s\": " << phase.cpu;
+	for (auto const& value: phase.values) {
+			file << ", " << jsonString(value.first) << ": " << value.second;
+			}
+	file << "}";
+	}
+
+void statsCollector::write(std::string fname, std::map<std::string, double> const& counters) {
+	std::lock_guard<std::mutex> lock(mutex);
+	std::ofstream file;
+	file.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+	file.open(fname, std::ofstream::trunc);
+	file << std::setprecision(9);
+	file << "{\n\t\"phases\": [";
+	for (size_t i = 0; i < phases.size(); ++i) {
+			file << (i ? ",\n\t\t" : "\n\t\t");
+			writePhase(file, phases[i]);
+			}
+	file << "\n\t],\n\t\"jobs\": [";
+	for (size_t i = 0; i < jobs.size(); ++i) {
+			file << (i ? ",\n\t\t" : "\n\t\t");
+			writePhase(file, jobs[i]);
+			}
+	file << "\n\t],\n\t\"counters\": {";
+	bool first = true;
+	for (auto const& counter: counters) {
+			file << (first ? "\n\t\t" : ",\n\t\t") << jsonString(counter.first) << ": " << counter.second;
+			first = false;
+			}
+	file << "\n\t}\n}\n";
+	}
+
+void writeTrace(std::string fname, std::vector<std::pair<traceLog*, std::string>> const& logs) {
+	std::ofstream file;
+	file.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+	file.open(fname, std::ofstream::trunc);
+	std::map<std::thread::id, unsigned int> tids; // Same thread in all logs, numbered by first appearance
+	std::int64_t start = std::numeric_limits<std::int64_t>::max();
+	for (auto const& log: logs) {
+			for (auto buffer: log.first->threads()) {
+					tids.emplace(buffer->thread, tids.size() + 1);
+					for (auto const& span: buffer->spans) {
+							start = std::min(start, span.begin);
+							}
+					}
+			}
+	file << std::fixed << std::setprecision(3);
+	file << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+	bool first = true;
+	for (auto const& tid: tids) {
+			file << (first ? "\n" : ",\n") << "{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": 1, \"tid\": " << tid.second
+				 << ", \"args\": {\"name\": \"" << (tid.first == std::this_thread::get_id() ? "main" : "thread " + std::to_string(tid.second)) << "\"}}";
+			first = false;
+			}
+	for (auto const& log: logs) {
+			for (auto buffer: log.first->threads()) {
+					for (auto const& span: buffer->spans) { // Times are in microseconds
+							file << (first ? "\n" : ",\n") << "{\"ph\": \"X\", \"name\": " << jsonString(span.name) << ", \"cat\": " << jsonString(log.second)
+								 << ", \"pid\": 1, \"tid\": " << tids[buffer->thread] << ", \"ts\": " << (span.begin - start) / 1e3 << ", \"dur\": " << (span.end - span.begin) / 1e3 << "}";
+							first = false;
+							}
+					}
+			}
+	file << "\n]}\n";
+	}
+// kate: indent-mode cstyle; indent-width 4; replace-tabs off; tab-width 4; 
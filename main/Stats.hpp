@@ -0,0 +1,60 @@
+#ifndef I_V_STATS
+#define I_V_STATS
+#pragma once
+
+#include "mainDefs.hpp"
+
+#include <chrono>
+#include <ctime>
+#include <thread>
+#include <condition_variable>
+
+class phaseTimer { // Measures wall time and CPU time (of process or of calling thread only) since construction
+	public:
+		explicit phaseTimer(bool thread = false);
+		double wall(); // In seconds
+		double cpu(); // In seconds
+
+	private:
+		double cpuNow();
+		bool thread;
+		std::chrono::steady_clock::time_point wallStart;
+		double cpuStart;
+	};
+
+struct phaseStats {
+	std::string name;
+	double wall = 0;
+	double cpu = 0;
+	std::map<std::string, double> values; // Extra numbers: bytes, tokens, rates, ...
+	};
+
+std::uintmax_t residentMemory(); // Of process now, in bytes (0 if unknown)
+
+class statsCollector { // Thread-safe collection of phases, written as JSON at the end
+	public:
+		~statsCollector();
+		void add(phaseStats phase); // Also records peak resident memory since previous phase, if watched
+		void addJob(phaseStats job); // Single train/merge job inside phase
+		void write(std::string fname, std::map<std::string, double> const& counters);
+		void watchMemory(); // Start sampling resident memory by background thread (short peaks are seen too)
+		void printMemory(std::ostream& o); // Peak of every phase, human-readable
+
+	private:
+		void sampleMemory(); // Body of sampling thread
+		std::mutex mutex;
+		std::vector<phaseStats> phases;
+		std::vector<phaseStats> jobs;
+		std::thread sampler;
+		std::condition_variable samplerCond;
+		bool samplerStop = false;
+		std::uintmax_t peak = 0; // Since previous phase
+	};
+
+phaseStats makePhase(std::string name, phaseTimer& timer);
+
+// Write spans as Chrome trace JSON; arguments: file name, logs with their categories
+void writeTrace(std::string fname, std::vector<std::pair<traceLog*, std::string>> const& logs);
+
+#endif
+// kate: indent-mode cstyle; indent-width 4; replace-tabs off; tab-width 4; 
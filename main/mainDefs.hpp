@@ -10,6 +10,10 @@
 #include <vector>
 #include <string>
 #include <memory>
+#include <future>
+#include <sstream>
+#include <cstdint>
+#include <limits>
 //#include <filesystem>
 
 #include <cstdlib>
@@ -22,6 +26,8 @@
 #include <boost/variant.hpp>
 #include <boost/dll/import.hpp>
 
+#include <generatorAPI.hpp>
+
 struct cacheop {
 	explicit cacheop(std::string const& val):
 		value(val)
@@ -34,13 +40,36 @@ struct opts {
 	opts(): cache("") {}
 	std::shared_ptr<std::ostream> out;
 	bool no_end = false;
+	unsigned long long count = 1;
+	std::uint64_t seed = 0;
+	double deadline = 0; // Per output, in milliseconds (0 = no limit)
+	std::uintmax_t max_bytes = 0; // Per output (0 = no limit)
+	std::string delimiter;
 	std::string backend;
 	std::vector<std::string> backend_opts;
 	unsigned int jobs;
+	std::uintmax_t chunk_size;
+	std::uintmax_t mmap_min;
+	std::size_t buffer_size;
+	std::uintmax_t memory_limit = 0; // 0 = no limit
 	cacheop cache;
 	std::string cachefile = "";
-	std::vector<std::shared_ptr<std::ifstream>> inpfiles;
-	std::map<std::shared_ptr<std::ifstream>, std::string> inpfiles_names;
+	std::string serve = "";
+	std::string stats = "";
+	std::string trace = "";
+	std::vector<std::shared_ptr<generatorInput>> inpfiles;
+
+	bool limited() const { return deadline > 0 or max_bytes > 0; }
+	outBudget budget() const { // For output starting now
+		outBudget res;
+		if (deadline > 0) {
+				res.deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::milli>(deadline));
+				}
+		if (max_bytes > 0) {
+				res.bytes = max_bytes;
+				}
+		return res;
+		}
 	};
 
 #endif
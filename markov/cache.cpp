@@ -1,11 +1,15 @@
 // This file implements save/load functions
 
 #include "interface.hpp"
+#include "cache.hpp"
 
 #include <iostream>
 #include <fstream>
+#include <cstring>
+#include <algorithm>
 
 #include <boost/serialization/serialization.hpp>
+#include <boost/serialization/library_version_type.hpp> // Not included by unordered_map.hpp in some boost versions
 
 #if MARKOV_OPT_MEMORY
 #include <boost/serialization/map.hpp>
@@ -20,30 +24,189 @@
 #include <boost/archive/text_iarchive.hpp>
 #include <boost/archive/text_oarchive.hpp>
 
+#include <boost/filesystem/operations.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
 namespace markov {
-	void markovBackend::save(std::string fname, boost::any& data) {
+	namespace bip = boost::interprocess;
+
+	// Caches without header have legacy layout (Hashtable)
+
+	cacheHeader makeHeader(unsigned int order, std::uint32_t tokens, std::uint32_t contexts, std::uint64_t transitions, std::uint64_t poolBytes, std::uint64_t slotCount, tokenId newline) {
+		cacheHeader h;
+		std::memset(&h, 0, sizeof(h));
+		std::memcpy(h.magic, (cacheMagic + '\n').data(), cacheMagic.size() + 1);
+		h.byteOrder = byteOrderMark;
+		h.order = order;
+		h.tokens = tokens;
+		h.contexts = contexts;
+		h.transitions = transitions;
+		h.poolBytes = poolBytes;
+		h.slotCount = slotCount;
+		h.shift = 64 - (slotCount != 0 ? __builtin_ctzll(slotCount) : 0);
+		h.newline = newline;
+		h.fileSize = cacheLayout(h).end;
+		return h;
+	}
+
+	void writeArray(std::ostream& file, const void* data, std::uint64_t bytes) {
+		static const char zeros[8] = {};
+		file.write(static_cast<const char*>(data), bytes);
+		file.write(zeros, (8 - bytes % 8) % 8);
+	}
+
+	std::string deltaName(std::string const& fname, unsigned int k) {
+		return fname + ".delta" + std::to_string(k);
+	}
+
+	static void writeCache(std::string const& fname, modelView const& v) {
+		cacheHeader h = makeHeader(v.contexts.order, v.tokens.count, v.contexts.count, v.transitions.size, v.tokens.starts[v.tokens.count], v.contexts.slotCount, v.newline);
+		// Old cache may be mapped right now (even by this process), so it is replaced, not overwritten
+		std::string tmpname = fname + ".tmp";
 		std::ofstream file;
 		file.exceptions ( std::ofstream::failbit | std::ofstream::badbit );
-		file.open(fname, std::ofstream::trunc);
+		file.open(tmpname, std::ofstream::trunc | std::ofstream::binary);
+		file.write(reinterpret_cast<const char*>(&h), sizeof(h));
+		writeArray(file, v.tokens.pool, h.poolBytes);
+		writeArray(file, v.tokens.starts, (std::uint64_t(h.tokens) + 1) * sizeof(std::uint64_t));
+		writeArray(file, v.contexts.keys, std::uint64_t(h.contexts) * h.order * sizeof(tokenId));
+		writeArray(file, v.contexts.hashes, std::uint64_t(h.contexts) * sizeof(std::uint64_t));
+		writeArray(file, v.contexts.slots, h.slotCount * sizeof(std::uint32_t));
+		writeArray(file, v.transitions.offsets, (std::uint64_t(h.contexts) + 1) * sizeof(std::uint64_t));
+		writeArray(file, v.transitions.nexts, h.transitions * sizeof(tokenId));
+		writeArray(file, v.transitions.counts, h.transitions * sizeof(std::uint64_t));
+		writeArray(file, v.transitions.thresholds, h.transitions * sizeof(std::uint64_t));
+		writeArray(file, v.transitions.aliases, h.transitions * sizeof(std::uint32_t));
+		writeArray(file, v.transitions.cumulative, (std::uint64_t(h.contexts) + 1) * sizeof(std::uint64_t));
+		writeArray(file, v.transitions.successors, h.transitions * sizeof(std::uint32_t));
+		file.close();
+		boost::filesystem::rename(tmpname, fname);
+	}
+
+	void markovBackend::save(std::string fname, boost::any& data) {
+		TRACE_SPAN(trace, "markov.save");
+		if (auto spilled = boost::any_cast<spilledModel>(&data)) {
+			writeRuns(spilled->runs, N, fname, spillDir);
+			data = loadMapped(fname); // Runs are not needed anymore, and frontend may exit without dropping data
+		} else {
+			writeCache(fname, compiledModel(data).view());
+		}
+		// Whole data is written, so deltas are in it already (compaction) or belong to replaced cache
+		for (unsigned int k = 1; boost::filesystem::exists(deltaName(fname, k)); ++k) {
+			boost::filesystem::remove(deltaName(fname, k));
+		}
+	};
+
+	void markovBackend::saveDelta(std::string fname, boost::any& data) { // Delta is usual cache of new inputs alone
+		TRACE_SPAN(trace, "markov.saveDelta");
+		unsigned int k = 1;
+		while (boost::filesystem::exists(deltaName(fname, k))) {
+			++k;
+		}
+		if (auto spilled = boost::any_cast<spilledModel>(&data)) {
+			writeRuns(spilled->runs, N, deltaName(fname, k), spillDir);
+			data = loadMapped(deltaName(fname, k));
+		} else {
+			writeCache(deltaName(fname, k), compiledModel(data).view());
+		}
+	};
+
+	model markovBackend::loadLegacy(std::istream& file) { // Tokens are interned while reading, old table is never kept whole
+		Hashtable tab;
 		{
-			Hashtable tab = boost::any_cast<Hashtable>(data);
-			boost::archive::text_oarchive oarch(file);
-			oarch << tab;
+			boost::archive::text_iarchive iarch(file);
+			iarch >> tab;
 		}
-		file.close();
+		modelBuilder m(N);
+		MarkovContext ctx(N);
+		for (auto const& entry: tab) {
+			if (entry.first.size() != N) {
+				throw std::invalid_argument("cache was made with N=" + std::to_string(entry.first.size()) + ", but config has N=" + std::to_string(N));
+			}
+			for (unsigned int i = 0; i < N; ++i) {
+				ctx[i] = m.intern(entry.first[i]);
+			}
+			m.add(ctx.data(), hashKey(ctx.data(), N), m.intern(entry.second));
+		}
+		return m.finish();
 	};
 
-	boost::any markovBackend::load(std::string fname) {
+	model markovBackend::loadMapped(std::string fname) {
+		auto region = std::make_shared<bip::mapped_region>(bip::file_mapping(fname.c_str(), bip::read_only), bip::read_only);
+		const char* base = static_cast<const char*>(region->get_address());
+		std::uint64_t size = region->get_size();
+		auto broken = [&fname](std::string what) {
+			return std::invalid_argument("cache `" + fname + "` is broken: " + what);
+		};
+		if (size < sizeof(cacheHeader)) {
+			throw broken("too short");
+		}
+		cacheHeader h;
+		std::memcpy(&h, base, sizeof(h));
+		std::string magic(h.magic, std::find(h.magic, h.magic + sizeof(h.magic), '\n'));
+		if (magic != cacheMagic) { // Other versions never left development
+			throw std::invalid_argument("cache `" + fname + "` has unsupported format version (" + magic + "), write it again from inputs with `-c w`");
+		}
+		if (h.byteOrder != byteOrderMark) {
+			throw std::invalid_argument("cache `" + fname + "` was made on machine with other byte order");
+		}
+		if (h.order != N) {
+			throw std::invalid_argument("cache was made with N=" + std::to_string(h.order) + ", but config has N=" + std::to_string(N));
+		}
+		// Sizes are checked before layout is computed, so it can't overflow
+		if (h.fileSize != size or h.poolBytes > size or h.transitions > size or h.slotCount > size or cacheLayout(h).end != size) {
+			throw broken("sizes don't match");
+		}
+		cacheLayout l(h);
+		model m;
+		m.mapped.tokens = {base + l.pool, reinterpret_cast<const std::uint64_t*>(base + l.starts), h.tokens};
+		m.mapped.contexts = {h.order, h.contexts, reinterpret_cast<const tokenId*>(base + l.keys), reinterpret_cast<const std::uint64_t*>(base + l.hashes),
+			reinterpret_cast<const std::uint32_t*>(base + l.slots), h.slotCount, h.shift};
+		m.mapped.transitions = {reinterpret_cast<const std::uint64_t*>(base + l.offsets), reinterpret_cast<const tokenId*>(base + l.nexts),
+			reinterpret_cast<const std::uint64_t*>(base + l.counts), reinterpret_cast<const std::uint64_t*>(base + l.thresholds),
+			reinterpret_cast<const std::uint32_t*>(base + l.aliases), reinterpret_cast<const std::uint64_t*>(base + l.cumulative),
+			reinterpret_cast<const std::uint32_t*>(base + l.successors), h.transitions};
+		m.mapped.newline = h.newline;
+		// Only ends are checked, the rest is trusted
+		std::uint32_t shift = 64 - (h.slotCount != 0 ? static_cast<std::uint32_t>(__builtin_ctzll(h.slotCount)) : 0);
+		if (h.tokens == 0 or m.mapped.tokens.starts[h.tokens] != h.poolBytes or m.mapped.transitions.offsets[h.contexts] != h.transitions
+				or (h.slotCount & (h.slotCount - 1)) != 0 or (h.contexts > 0 and h.slotCount <= h.contexts) or h.shift != shift) {
+			throw broken("tables don't match");
+		}
+		m.mappedBytes = size;
+		m.mapping = std::move(region);
+		return m;
+	};
+
+	model markovBackend::loadBase(std::string fname) {
 		checkFile(fname);
 		std::ifstream file;
 		file.exceptions ( std::ifstream::failbit | std::ifstream::badbit );
 		file.open(fname);
-		Hashtable tab;
-		{
-			boost::archive::text_iarchive iarch(file);
-			iarch >> tab;
+		std::string magic;
+		std::getline(file, magic);
+		if (magic.compare(0, 13, "markov-cache ") != 0) {
+			file.seekg(0);
+			return loadLegacy(file);
 		}
 		file.close();
-		return tab;
+		return loadMapped(fname);
+	};
+
+	boost::any markovBackend::load(std::string fname) {
+		TRACE_SPAN(trace, "markov.load");
+		model base = loadBase(fname);
+		if (!boost::filesystem::exists(deltaName(fname, 1))) {
+			return base; // Used in place if mapped
+		}
+		// Deltas are added up in memory as training results are; compaction writes sum, so next load maps it again
+		std::vector<boost::any> parts;
+		parts.push_back(std::move(base));
+		for (unsigned int k = 1; boost::filesystem::exists(deltaName(fname, k)); ++k) {
+			parts.push_back(loadMapped(deltaName(fname, k)));
+		}
+		std::cout << "Cache `" << fname << "` has " << parts.size() - 1 << " delta(s), whole model is rebuilt in memory; compact it with `-c c` to load it in place again" << std::endl;
+		return merge(parts);
 	};
 }
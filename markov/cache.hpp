@@ -0,0 +1,58 @@
+#pragma once
+
+#include "model.hpp"
+
+#include <ostream>
+#include <string>
+
+// Binary cache of markov backend is first line (magic) and then binary image of final model: header and arrays of `modelView`, each at multiple of 8 bytes.
+// It is mapped read-only and used in place, so loading costs nothing until pages are touched. Byte order is native.
+
+namespace markov {
+	static const std::string cacheMagic = "markov-cache 5";
+
+	struct cacheHeader {
+		char magic[16]; // cacheMagic, '\n' and zero padding
+		std::uint32_t byteOrder; // byteOrderMark as written
+		std::uint32_t order;
+		std::uint32_t tokens;
+		std::uint32_t contexts;
+		std::uint64_t transitions;
+		std::uint64_t poolBytes;
+		std::uint64_t slotCount;
+		std::uint32_t shift;
+		tokenId newline;
+		std::uint64_t fileSize;
+	};
+	static const std::uint32_t byteOrderMark = 0x01020304;
+
+	struct cacheLayout { // Offsets of arrays inside file
+		std::uint64_t pool, starts, keys, hashes, slots, offsets, nexts, counts, thresholds, aliases, cumulative, successors, end;
+
+		explicit cacheLayout(cacheHeader const& h) {
+			std::uint64_t at = sizeof(cacheHeader);
+			auto place = [&at](std::uint64_t bytes) {
+				std::uint64_t res = at;
+				at += (bytes + 7) / 8 * 8;
+				return res;
+			};
+			pool = place(h.poolBytes);
+			starts = place((std::uint64_t(h.tokens) + 1) * sizeof(std::uint64_t));
+			keys = place(std::uint64_t(h.contexts) * h.order * sizeof(tokenId));
+			hashes = place(std::uint64_t(h.contexts) * sizeof(std::uint64_t));
+			slots = place(h.slotCount * sizeof(std::uint32_t));
+			offsets = place((std::uint64_t(h.contexts) + 1) * sizeof(std::uint64_t));
+			nexts = place(h.transitions * sizeof(tokenId));
+			counts = place(h.transitions * sizeof(std::uint64_t));
+			thresholds = place(h.transitions * sizeof(std::uint64_t));
+			aliases = place(h.transitions * sizeof(std::uint32_t));
+			cumulative = place((std::uint64_t(h.contexts) + 1) * sizeof(std::uint64_t));
+			successors = place(h.transitions * sizeof(std::uint32_t));
+			end = at;
+		};
+	};
+
+	cacheHeader makeHeader(unsigned int order, std::uint32_t tokens, std::uint32_t contexts, std::uint64_t transitions, std::uint64_t poolBytes, std::uint64_t slotCount, tokenId newline);
+	void writeArray(std::ostream& file, const void* data, std::uint64_t bytes); // Padded with zeros to multiple of 8
+	std::string deltaName(std::string const& fname, unsigned int k); // Deltas of cache are numbered from 1 without gaps
+}
@@ -8,11 +8,14 @@
 #include <unordered_map>
 #endif
 
+#include "model.hpp"
+#include "spill.hpp"
+#include "shared.hpp"
+
 #include <deque>
+#include <mutex>
 #include <utility>
 #include <boost/regex.hpp>
-#include <boost/random.hpp>
-#include <boost/random/random_device.hpp>
 #include <boost/functional/hash.hpp>
 
 template <typename Container> // we can make this generic for any container
@@ -23,32 +26,67 @@ struct container_hash {
 };
 
 namespace markov {
+	// Layout of caches written before tokens were interned, only for loading them
 	using MarkovDeque = std::deque<std::string>;
 	#if MARKOV_OPT_MEMORY
 	using Hashtable = std::multimap<MarkovDeque, std::string>;
 	#else
 	using Hashtable = std::unordered_multimap<MarkovDeque, std::string, container_hash<MarkovDeque>>;
 	#endif
-	template<typename T>
-	void shiftDeque(std::deque<T>&, T&);
 	void checkFile(std::string fname);
+	class markovBackend;
+	class markovState: public generatorState { // Walk through automaton
+		public:
+			markovState(markovBackend& backend, const model& m, std::uint64_t seed): backend(backend), m(m.view()), gen(seed) {};
+			~markovState();
+			markovBackend& backend;
+			modelView m; // Model stays alive while outputs are made
+			generatorRandom gen;
+			std::uint32_t at = contextView::none; // Current context
+			unsigned long long int n = 0; // Tokens given
+			bool done = false;
+	};
 	class markovBackend: public generatorAPI {
 		public:
 			void init(std::vector<std::string>);
-			void trainBegin(std::vector<std::shared_ptr<std::ifstream>>) {};
-			boost::any train(std::shared_ptr<std::ifstream>);
+			void trainBegin(std::vector<std::shared_ptr<generatorInput>>);
+			boost::any train(std::shared_ptr<generatorInput>);
 			boost::any merge(std::vector<boost::any>&);
 			void out(boost::any&, std::shared_ptr<std::ostream>);
+			void outBatch(boost::any&, std::vector<std::shared_ptr<std::ostream>>&, std::uint64_t);
+			bool outConcurrent() { return true; };
+			std::unique_ptr<generatorState> outBegin(boost::any&, std::uint64_t);
+			bool outNext(generatorState&, std::string&);
 
 			boost::any load(std::string);
 			void save(std::string, boost::any&);
+			bool appendDelta() { return true; };
+			void saveDelta(std::string, boost::any&);
+
+			bool mergeIncremental() { return !sharedTraining; }; // Shared table is taken once, by final merge
+			std::string_view::size_type chunkBoundary(std::string_view);
+			std::uintmax_t dataSize(boost::any&);
 
 		protected:
-			void trainPart(std::string, Hashtable&);
-			void trainFinal(std::string, Hashtable&, MarkovDeque&);
-			void trainInsert(std::string, Hashtable&, MarkovDeque&);
+			// Training loop is compiled for every window size, `init` selects one of them by N (generation has no window, see `outNext`)
+			template<unsigned int Order> void select();
+			boost::any (markovBackend::*trainImpl)(std::shared_ptr<generatorInput>) = nullptr;
 
-			std::string outGet(Hashtable&, MarkovDeque&);
+			template<class Window> boost::any trainWith(std::shared_ptr<generatorInput>);
+			template<class Window, class Builder> void trainInput(generatorInput&, Builder&); // Builder is modelBuilder or sharedBuilder::writer
+			template<class Window, class Builder> void trainPart(const char*, const char*, Builder&);
+			template<class Window, class Builder> void trainLines(const char*, const char*, Builder&, Window&);
+			template<class Window, class Builder> void trainFinal(const char*, const char*, Builder&, Window&);
+			template<class Window, class Builder> void trainInsert(std::string_view, Builder&, Window&);
+
+			boost::any mergeSpilled(std::vector<boost::any>&);
+			const model& modelOf(boost::any&); // Spilled data is merged into temporary cache on first use
+			const model& compiledModel(boost::any&); // Compiles model on first use
+
+			void outOne(boost::any&, std::shared_ptr<std::ostream>, std::uint64_t);
+			model loadLegacy(std::istream&);
+			model loadBase(std::string fname); // Cache without deltas, legacy or binary
+			model loadMapped(std::string fname); // Binary cache, used in place
 
 			std::string iter;
 			std::string prefixmiddle;
@@ -57,10 +95,12 @@ namespace markov {
 			unsigned long long int maxgen;
 			bool rndstart;
 			boost::regex separator;
+			std::uintmax_t spill; // Bytes, 0 = never
+			std::string spillDir;
+			bool sharedTraining;
+			std::shared_ptr<sharedBuilder> shared; // Set from `trainBegin` to final `merge` in shared-state training
 
-			boost::sregex_token_iterator xInvalidTokenIt;
-			boost::sregex_iterator xInvalidIt;
-
-			boost::mt19937 gen; 
+			boost::cregex_token_iterator xInvalidTokenIt;
+			boost::cregex_iterator xInvalidIt;
 	};
 }
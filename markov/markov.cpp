@@ -1,4 +1,6 @@
 #include "interface.hpp"
+#include <inputBlocks.hpp>
+#include <chunkBoundary.hpp>
 #include <streambuf>
 #include <algorithm>
 #include <boost/dll/alias.hpp>
@@ -8,11 +10,7 @@
 namespace po = boost::program_options;
 
 namespace markov {
-	template<typename T>
-	void shiftDeque(std::deque<T> &dq, T &elem) {
-		dq.pop_front();
-		dq.push_back(elem);
-	};
+	static const std::size_t sharedShards = 64; // Locks of shared table: many more than jobs, so they rarely wait
 
 	void checkFile(std::string fname) {
 		if (!boost::filesystem::exists(fname)) {
@@ -96,7 +94,10 @@ namespace markov {
 			("splitstr", po::value<bool>()->required(), "parse string by string, not all file")
 			("maxgen", po::value<unsigned long long int>()->required(), "do not print more than maxgen block  (zero to no limit)")
 			("rndstart", po::value<bool>()->default_value(false, "false"), "start from random combination")
-			("separator", po::value<std::string>(), "block separator (regex)");
+			("separator", po::value<std::string>(), "block separator (regex)")
+			("spill", po::value<std::uintmax_t>()->default_value(0), "train on disk: when model of job grows over this many megabytes, write its counts to sorted run file and merge runs into cache at the end (0 = keep all in memory)")
+			("spill_dir", po::value<std::string>(), "directory for run files (system temporary directory by default)")
+			("shared", po::value<bool>()->default_value(false, "false"), "all jobs count into one table split into shards by context, instead of own models merged at the end");
 		if (opts.front() == "helpme") {
 			std::cout << "Due to restrictions of boost::program_options, options prints in cmd format." << std::endl
 			<< "Actual format is ini-like `opt=val`. All strings must be placed into \"\" and most of C escapes (`\\n` for example) will be applied to them."
@@ -119,110 +120,272 @@ namespace markov {
 		maxgen = vm["maxgen"].as<unsigned long long int>();
 		rndstart = vm["rndstart"].as<bool>();
 		separator = vm.count("separator") ? configString("separator", vm) : "";
+		spill = vm["spill"].as<std::uintmax_t>() << 20;
+		spillDir = vm.count("spill_dir") ? configString("spill_dir", vm) : boost::filesystem::temp_directory_path().string();
+		sharedTraining = vm["shared"].as<bool>();
+		if (sharedTraining and spill != 0) {
+			throw std::invalid_argument("shared and spill can't be used together");
+		}
+		switch (N) { // Windows of fixed size are kept in registers and arrays, others in vector
+			case 1: select<1>(); break;
+			case 2: select<2>(); break;
+			case 3: select<3>(); break;
+			case 4: select<4>(); break;
+			case 5: select<5>(); break;
+			case 6: select<6>(); break;
+			case 7: select<7>(); break;
+			case 8: select<8>(); break;
+			default: select<anyOrder>();
+		}
+	};
 
-		boost::random_device seed_gen;
-		gen = boost::mt19937(seed_gen()); 
+	template<unsigned int Order>
+	void markovBackend::select() {
+		trainImpl = &markovBackend::trainWith<contextWindow<Order>>;
 	};
 
-	void markovBackend::trainPart(std::string data, Hashtable& tab) {
-		MarkovDeque dq(N, "");
+	template<class Window, class Builder>
+	void markovBackend::trainPart(const char* begin, const char* end, Builder& m) {
+		Window ctx(N);
+		trainLines(begin, end, m, ctx);
+		trainInsert("", m, ctx); // Insert end
+	};
+
+	template<class Window, class Builder>
+	void markovBackend::trainLines(const char* begin, const char* end, Builder& m, Window& ctx) {
 		if (splitstr) {
-			boost::sregex_token_iterator linesIter(data.begin(), data.end(), boost::regex("\n+"), -1);
+			boost::cregex_token_iterator linesIter(begin, end, boost::regex("\n+"), -1);
 			while(linesIter != xInvalidTokenIt) {
-				trainFinal(*linesIter++, tab, dq);
-				trainInsert("\n", tab, dq);
+				auto line = *linesIter++;
+				trainFinal(line.first, line.second, m, ctx);
+				trainInsert("\n", m, ctx);
 			}
 		} else {
-			trainFinal(data, tab, dq);
+			trainFinal(begin, end, m, ctx);
 		}
-		tab.emplace(dq, ""); // Insert end
 	};
 
-	void markovBackend::trainFinal(std::string data, Hashtable& tab, MarkovDeque& dq) {
-		boost::sregex_iterator blocksIter(data.begin(), data.end(), boost::regex(iter));
+	template<class Window, class Builder>
+	void markovBackend::trainFinal(const char* begin, const char* end, Builder& m, Window& ctx) {
+		boost::cregex_iterator blocksIter(begin, end, boost::regex(iter));
 		while (blocksIter != xInvalidIt) {
-			trainInsert((blocksIter++)->str(), tab, dq);
+			auto const& match = (*blocksIter++)[0];
+			trainInsert(std::string_view(match.first, match.length()), m, ctx);
 		}
 	};
 
-	void markovBackend::trainInsert(std::string data, Hashtable& tab, MarkovDeque& dq) {
-		tab.emplace(dq, data);
-		shiftDeque<std::string>(dq, data);
+	template<class Window, class Builder>
+	void markovBackend::trainInsert(std::string_view data, Builder& m, Window& ctx) {
+		tokenId id = m.intern(data);
+		m.add(ctx.data(), ctx.hash(), id);
+		ctx.push(id);
 	}
 
-	boost::any markovBackend::train(std::shared_ptr<std::ifstream> file) {
-		Hashtable tab;
-		std::string content;
-		{
-			file->seekg(0, std::ios::end);   
-			content.reserve(file->tellg());
-			file->seekg(0, std::ios::beg);
-
-			content.assign((std::istreambuf_iterator<char>(*file)),
-							std::istreambuf_iterator<char>());
-			file->close();
-		}
-		if (separator != boost::regex("")) {
-			boost::sregex_token_iterator partsIter(content.begin(), content.end(), separator, -1);
-			while(partsIter != xInvalidTokenIt) {
-				trainPart(*partsIter++, tab);
-			}
-		} else {
-			trainPart(content, tab);
+	void markovBackend::trainBegin(std::vector<std::shared_ptr<generatorInput>>) {
+		if (sharedTraining) {
+			shared = std::make_shared<sharedBuilder>(N, sharedShards);
 		}
-		return tab;
+	};
+
+	boost::any markovBackend::train(std::shared_ptr<generatorInput> input) {
+		TRACE_SPAN(trace, "markov.train");
+		return (this->*trainImpl)(input);
+	};
+
+	template<class Window>
+	boost::any markovBackend::trainWith(std::shared_ptr<generatorInput> input) {
+		if (shared) {
+			sharedBuilder::writer w(*shared);
+			trainInput<Window>(*input, w);
+			w.flush();
+			count("train.tokens", w.total());
+			return boost::any(); // Counts are in shared table, `merge` takes them
+		}
+		modelBuilder m(N);
+		std::vector<std::shared_ptr<spillRun>> runs;
+		if (spill != 0) {
+			m.spillAt(spill, [this, &runs](model&& part) {
+				TRACE_SPAN(trace, "markov.spill");
+				runs.push_back(spillRun::write(part.view(), spillDir));
+			});
+		}
+		trainInput<Window>(*input, m);
+		count("train.tokens", m.total());
+		if (runs.empty()) {
+			return m.finish();
+		}
+		TRACE_SPAN(trace, "markov.spill");
+		runs.push_back(spillRun::write(m.finish().view(), spillDir));
+		return spilledModel(N, std::move(runs));
+	};
+
+	template<class Window, class Builder>
+	void markovBackend::trainInput(generatorInput& input, Builder& m) {
+		if (separator != boost::regex("")) { // Parts are independent
+			readBlocks(input, separator, [this, &m](const char* begin, const char* end) {
+				TRACE_SPAN(trace, "markov.block"); // Per block, not per line or token: trace of big corpus stays small
+				boost::cregex_token_iterator partsIter(begin, end, separator, -1);
+				while(partsIter != xInvalidTokenIt) {
+					auto part = *partsIter++;
+					trainPart<Window>(part.first, part.second, m);
+				}
+			});
+		} else { // Whole input is one part, context goes through blocks
+			Window ctx(N);
+			readBlocks(input, splitstr ? boost::regex("\n+") : boost::regex(iter), [this, &m, &ctx](const char* begin, const char* end) {
+				TRACE_SPAN(trace, "markov.block");
+				trainLines(begin, end, m, ctx);
+			});
+			trainInsert("", m, ctx); // Insert end
+		}
+	};
+
+	std::string_view::size_type markovBackend::chunkBoundary(std::string_view data) {
+		return markovChunkBoundary(data, separator, splitstr);
 	};
 
 	boost::any markovBackend::merge(std::vector<boost::any>& vec) {
-		if (vec.size() == 1) { return vec.front(); }
-		auto first = boost::any_cast<Hashtable>(vec.front());
-		for(auto i = ++vec.begin(); i != vec.end(); ++i) {
-			first.merge(boost::any_cast<Hashtable>(*i));
+		if (shared) { // Results of train jobs are empty, counts are taken from shared table
+			TRACE_SPAN(trace, "markov.mergeShared");
+			vec.push_back(shared->finish());
+			shared.reset();
+			vec.erase(std::remove_if(vec.begin(), vec.end(), [](const boost::any& a) { return a.empty(); }), vec.end());
+		}
+		if (vec.size() == 1) { return std::move(vec.front()); }
+		TRACE_SPAN(trace, "markov.merge");
+		if (spill != 0) { // Results go to disk if any of them is there already or they would not fit together
+			std::uintmax_t inMemory = 0;
+			bool spilled = false;
+			for (auto& a: vec) {
+				if (boost::any_cast<spilledModel>(&a)) {
+					spilled = true;
+				} else {
+					inMemory += boost::any_cast<const model&>(a).memory();
+				}
+			}
+			if (spilled or inMemory > spill) {
+				return mergeSpilled(vec);
+			}
+		}
+		// Counting continues in biggest model (its tokens and contexts keep numbers), others are added into it
+		auto biggest = std::max_element(vec.begin(), vec.end(), [](const boost::any& a, const boost::any& b) {
+			return boost::any_cast<const model&>(a).size() < boost::any_cast<const model&>(b).size();
+		});
+		modelBuilder first(std::move(boost::any_cast<model&>(*biggest)));
+		for (auto i = vec.begin(); i != vec.end(); ++i) {
+			if (i != biggest) {
+				first.merge(boost::any_cast<const model&>(*i));
+				*i = boost::any(); // Free it right now
+			}
 		}
-		return first;
+		return first.finish();
+	};
+
+	boost::any markovBackend::mergeSpilled(std::vector<boost::any>& vec) { // Runs are only collected, they are merged by `save` or first output
+		spilledModel res(N);
+		for (auto& a: vec) {
+			if (auto part = boost::any_cast<spilledModel>(&a)) {
+				res.runs.insert(res.runs.end(), part->runs.begin(), part->runs.end());
+			} else if (boost::any_cast<const model&>(a).size() > 0) {
+				TRACE_SPAN(trace, "markov.spill");
+				res.runs.push_back(spillRun::write(boost::any_cast<const model&>(a).view(), spillDir));
+			}
+			a = boost::any();
+		}
+		return res;
+	};
+
+	const model& markovBackend::modelOf(boost::any& data) {
+		auto spilled = boost::any_cast<spilledModel>(&data);
+		if (!spilled) {
+			return compiledModel(data);
+		}
+		std::call_once(*spilled->once, [this, spilled]() {
+			TRACE_SPAN(trace, "markov.mergeRuns");
+			std::string fname = (boost::filesystem::path(spillDir) / boost::filesystem::unique_path("markov-%%%%-%%%%-%%%%-%%%%.cache")).string();
+			writeRuns(spilled->runs, N, fname, spillDir);
+			*spilled->ready = loadMapped(fname);
+			boost::filesystem::remove(fname); // Mapping stays valid
+			spilled->runs.clear();
+		});
+		return *spilled->ready;
+	};
+
+	const model& markovBackend::compiledModel(boost::any& data) {
+		model& m = boost::any_cast<model&>(data);
+		std::call_once(*m.compileOnce, [this, &m]() { // Once it is done, this is only atomic check
+			TRACE_SPAN(trace, "markov.compile");
+			m.compile();
+		});
+		return m;
+	};
+
+	std::uintmax_t markovBackend::dataSize(boost::any& Am) {
+		if (Am.empty()) {
+			return 0; // Train job of shared-state training, its counts are in shared table
+		}
+		if (boost::any_cast<spilledModel>(&Am)) {
+			return spill; // Result is on disk, but job that made it held up to the limit
+		}
+		return boost::any_cast<const model&>(Am).memory();
 	};
 
 	void markovBackend::out(boost::any& Atab, std::shared_ptr<std::ostream> o) {
-		auto tab = boost::any_cast<Hashtable>(Atab);
-		MarkovDeque dq;
-		if (rndstart) {
-			int num = boost::random::uniform_int_distribution<>(0, tab.size()-1)(gen);
-			dq = std::next(tab.begin(), num)->first;
+		outOne(Atab, o, outputSeed(0));
+	};
+
+	void markovBackend::outBatch(boost::any& Atab, std::vector<std::shared_ptr<std::ostream>>& outs, std::uint64_t first) {
+		for (std::size_t i = 0; i < outs.size(); ++i) {
+			outOne(Atab, outs[i], outputSeed(first + i));
+		}
+	};
+
+	void markovBackend::outOne(boost::any& Atab, std::shared_ptr<std::ostream> o, std::uint64_t seed) {
+		TRACE_SPAN(trace, "markov.outOne");
+		auto state = outBegin(Atab, seed);
+		std::string piece;
+		while (outNext(*state, piece)) {
+			(*o) << piece;
+		}
+	};
+
+	markovState::~markovState() {
+		backend.count("out.tokens", n);
+	};
+
+	std::unique_ptr<generatorState> markovBackend::outBegin(boost::any& Am, std::uint64_t seed) {
+		const model& m = modelOf(Am); // Only read, so may be shared between threads
+		auto state = std::make_unique<markovState>(*this, m, seed); // Own generator for every output
+		if (rndstart and m.size() > 0) {
+			state->at = state->m.transitions.occurrence(m.size(), state->gen); // As often as context is seen in inputs
 		} else {
-			dq = MarkovDeque(N, "");
-		}
-		std::string str = outGet(tab, dq);
-		unsigned long long int n = 0;
-		while(str != "") {
-			(*o) << str;
-			if (str != "\n") { (*o) << prefixmiddle; };
-			if (maxgen > 0) {
-				if (++n == maxgen) { return; }; // We reached limit
-			}
-			shiftDeque(dq, str);
-			str = outGet(tab, dq);
-		}
-	};
-
-	std::string markovBackend::outGet(Hashtable& tab, MarkovDeque& dq) {
-		if (tab.count(dq) == 0) { return ""; } // Not found at all, hopeless
-		else if (tab.count(dq) == 1) { return tab.find(dq)->second; } // If only one math, return it
-		/* else if (try_valid) { // Probably, remove this
-			std::vector<std::string> vec;
-			auto range = tab.equal_range(dq);
-			for_each (range.first, range.second,
-			[&vec](Hashtable::value_type& x) {
-				if (x.second != "") {
-					vec.push_back(x.second);
-				};
-			});
-			if (vec.size() == 0) { return ""; } // Only endings, hopeless
-			int num = boost::random::uniform_int_distribution<>(0, vec.size()-1)(gen);
-			return vec.at(num);
-		} */ else {
-			int num = boost::random::uniform_int_distribution<>(0, tab.count(dq)-1)(gen);
-			return std::next(tab.equal_range(dq).first, num)->second;
+			MarkovContext start(N, endToken);
+			state->at = state->m.contexts.find(start.data(), hashKey(start.data(), N));
+		}
+		return state;
+	};
+
+	bool markovBackend::outNext(generatorState& Astate, std::string& piece) {
+		auto& state = static_cast<markovState&>(Astate);
+		if (state.done) { return false; }
+		// Context is only a number: transition gives token and number of next context, nothing is hashed or compared
+		const transitionView& t = state.m.transitions;
+		if (state.at == contextView::none or t.begin(state.at) == t.end(state.at)) { // Not found at all, hopeless
+			state.done = true;
+			return false;
+		}
+		std::uint64_t i = t.pick(state.at, state.gen);
+		tokenId id = t.nexts[i];
+		if (id == endToken) { // End of text
+			state.done = true;
+			return false;
 		}
+		piece = state.m.tokens.str(id);
+		if (id != state.m.newline) { piece += prefixmiddle; };
+		++state.n;
+		if (maxgen > 0 and state.n == maxgen) { state.done = true; }; // We reached limit
+		state.at = t.successors[i];
+		return true;
 	};
 
 	markovBackend backendInterface;
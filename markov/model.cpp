@@ -0,0 +1,427 @@
+#include "model.hpp"
+
+#include <functional>
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
+
+namespace markov {
+	std::size_t slotsFor(std::size_t count) {
+		std::size_t res = 16;
+		while (res / 4 * 3 <= count) {
+			res *= 2;
+		}
+		return res;
+	}
+
+	std::uint64_t stringHash(const std::uint64_t* tokenHashes, const tokenId* key, unsigned int order) {
+		std::uint64_t hash = 0;
+		for (unsigned int i = 0; i < order; ++i) {
+			hash = hash * hashBase + tokenHashes[key[i]];
+		}
+		return hash;
+	}
+
+	tokenTable::tokenTable() {
+		rehash(16);
+		intern(""); // endToken
+	};
+
+	tokenId tokenTable::find(std::string_view str) const {
+		std::uint64_t hash = std::hash<std::string_view>()(str);
+		for (std::size_t i = slot(hash);; i = (i + 1) & (slots.size() - 1)) {
+			tokenId id = slots[i];
+			if (id == none) {
+				return none;
+			}
+			if (hashes[id] == hash and this->str(id) == str) {
+				return id;
+			}
+		}
+	};
+
+	tokenId tokenTable::intern(std::string_view str) {
+		std::uint64_t hash = std::hash<std::string_view>()(str);
+		std::size_t i = slot(hash);
+		for (;; i = (i + 1) & (slots.size() - 1)) {
+			tokenId id = slots[i];
+			if (id == none) {
+				break;
+			}
+			if (hashes[id] == hash and this->str(id) == str) {
+				return id;
+			}
+		}
+		tokenId id = size();
+		if (id == none) {
+			throw std::length_error("too many distinct tokens");
+		}
+		pool.append(str);
+		starts.push_back(pool.size());
+		hashes.push_back(hash);
+		if (slots.size() / 4 * 3 <= size()) {
+			rehash(slots.size() * 2);
+		} else {
+			slots[i] = id;
+		}
+		return id;
+	};
+
+	void tokenTable::rehash(std::size_t count) {
+		slots.assign(count, none);
+		for (tokenId id = 0; id < size(); ++id) {
+			std::size_t i = slot(hashes[id]);
+			while (slots[i] != none) {
+				i = (i + 1) & (slots.size() - 1);
+			}
+			slots[i] = id;
+		}
+	};
+
+	std::uintmax_t tokenTable::memory() const {
+		return pool.capacity() + starts.capacity() * sizeof(std::uint64_t) + hashes.capacity() * sizeof(std::uint64_t) + slots.capacity() * sizeof(tokenId);
+	};
+
+	bool contextTable::equal(std::uint32_t ctx, const tokenId* key) const {
+		return std::equal(key, key + order, this->key(ctx));
+	};
+
+	std::uint32_t contextView::find(const tokenId* key, std::uint64_t hash) const {
+		if (slotCount == 0) {
+			return none;
+		}
+		for (std::size_t i = slot(hash);; i = (i + 1) & (slotCount - 1)) {
+			std::uint32_t entry = slots[i];
+			if (entry == 0) {
+				return none;
+			}
+			if (hashes[entry - 1] == hash and std::equal(key, key + order, this->key(entry - 1))) {
+				return entry - 1;
+			}
+		}
+	};
+
+	std::uint32_t contextTable::insert(const tokenId* key, std::uint64_t hash) {
+		if (slots.size() / 4 * 3 <= hashes.size()) {
+			rehash(slots.empty() ? 16 : slots.size() * 2);
+		}
+		std::size_t i = slot(hash);
+		for (;; i = (i + 1) & (slots.size() - 1)) {
+			std::uint32_t entry = slots[i];
+			if (entry == 0) {
+				break;
+			}
+			if (hashes[entry - 1] == hash and equal(entry - 1, key)) {
+				return entry - 1;
+			}
+		}
+		std::uint32_t ctx = hashes.size();
+		if (ctx == none) {
+			throw std::length_error("too many distinct contexts");
+		}
+		keys.insert(keys.end(), key, key + order);
+		hashes.push_back(hash);
+		slots[i] = ctx + 1;
+		return ctx;
+	};
+
+	void contextTable::reserve(std::size_t count) {
+		keys.reserve(count * order);
+		hashes.reserve(count);
+		if (slotsFor(count) > slots.size()) {
+			rehash(slotsFor(count));
+		}
+	};
+
+	void contextTable::rehash(std::size_t count) {
+		slots.assign(count, 0);
+		shift = 64;
+		for (std::size_t c = count; c > 1; c /= 2) {
+			--shift;
+		}
+		for (std::uint32_t ctx = 0; ctx < hashes.size(); ++ctx) {
+			std::size_t i = slot(hashes[ctx]);
+			while (slots[i] != 0) {
+				i = (i + 1) & (slots.size() - 1);
+			}
+			slots[i] = ctx + 1;
+		}
+	};
+
+	std::uintmax_t contextTable::memory() const {
+		return keys.capacity() * sizeof(tokenId) + hashes.capacity() * sizeof(std::uint64_t) + slots.capacity() * sizeof(std::uint32_t);
+	};
+
+	void transitionCounter::add(std::uint32_t ctx, tokenId next, std::uint64_t count) {
+		if (slots.size() / 4 * 3 <= used) {
+			rehash(slots.empty() ? 16 : slots.size() * 2);
+		}
+		std::uint64_t key = std::uint64_t(ctx) << 32 | next;
+		std::size_t i = slot(key);
+		while (slots[i].count != 0 and slots[i].key != key) {
+			i = (i + 1) & (slots.size() - 1);
+		}
+		if (slots[i].count == 0) {
+			slots[i].key = key;
+			++used;
+		}
+		slots[i].count += count;
+		sum += count;
+	};
+
+	void transitionCounter::rehash(std::size_t count) {
+		std::vector<entry> old(count, entry{0, 0});
+		old.swap(slots);
+		shift = 64;
+		for (std::size_t c = count; c > 1; c /= 2) {
+			--shift;
+		}
+		for (auto const& e: old) {
+			if (e.count != 0) {
+				std::size_t i = slot(e.key);
+				while (slots[i].count != 0) {
+					i = (i + 1) & (slots.size() - 1);
+				}
+				slots[i] = e;
+			}
+		}
+	};
+
+	void transitionTable::build(std::uint32_t contexts, transitionCounter const& counter) {
+		// Counting sort by context
+		offsets.assign(std::size_t(contexts) + 1, 0);
+		counter.forEach([this](std::uint32_t ctx, tokenId, std::uint64_t) { ++offsets[ctx + 1]; });
+		for (std::uint32_t ctx = 0; ctx < contexts; ++ctx) {
+			offsets[ctx + 1] += offsets[ctx];
+		}
+		nexts.resize(counter.size());
+		counts.resize(counter.size());
+		std::vector<std::uint64_t> pos(offsets.begin(), offsets.end() - 1);
+		counter.forEach([this, &pos](std::uint32_t ctx, tokenId next, std::uint64_t count) {
+			nexts[pos[ctx]] = next;
+			counts[pos[ctx]] = count;
+			++pos[ctx];
+		});
+		successors.clear();
+		buildAliases();
+	};
+
+	void transitionTable::build(std::vector<std::uint64_t> offsets, std::vector<tokenId> nexts, std::vector<std::uint64_t> counts) {
+		this->offsets = std::move(offsets);
+		this->nexts = std::move(nexts);
+		this->counts = std::move(counts);
+		successors.clear();
+		buildAliases();
+	};
+
+	void transitionTable::compile(contextView const& contexts) {
+		successors.resize(nexts.size());
+		compileSuccessors(contexts, view(), successors.data());
+	};
+
+	void compileSuccessors(contextView const& contexts, transitionView const& transitions, std::uint32_t* successors) {
+		unsigned int order = contexts.order;
+		MarkovContext key(order);
+		for (std::uint32_t ctx = 0; ctx < contexts.count; ++ctx) {
+			if (order > 0) {
+				std::copy(contexts.key(ctx) + 1, contexts.key(ctx) + order, key.begin()); // Oldest token goes away
+			}
+			for (std::uint64_t i = transitions.begin(ctx); i < transitions.end(ctx); ++i) {
+				if (order > 0) {
+					key[order - 1] = transitions.nexts[i];
+				}
+				// Training always counts the next window too, so only end of text has no successor
+				successors[i] = contexts.find(key.data(), hashKey(key.data(), order));
+			}
+		}
+	}
+
+	std::uint64_t aliasBuilder::build(const std::uint64_t* counts, std::uint64_t k, std::uint64_t* thresholds, std::uint32_t* aliases) {
+		// Vose: every column holds `total` of probability mass, mass of token is count * k, so all arithmetic is exact
+		std::uint64_t total = 0;
+		for (std::uint64_t i = 0; i < k; ++i) {
+			total += counts[i];
+		}
+		small.clear();
+		large.clear();
+		scaled.resize(k);
+		for (std::uint64_t i = 0; i < k; ++i) {
+			scaled[i] = (unsigned __int128) counts[i] * k;
+			(scaled[i] < total ? small : large).push_back(i);
+		}
+		while (!small.empty() and !large.empty()) {
+			std::uint32_t s = small.back(), l = large.back();
+			small.pop_back();
+			thresholds[s] = scaled[s];
+			aliases[s] = l;
+			scaled[l] -= total - scaled[s];
+			if (scaled[l] < total) {
+				large.pop_back();
+				small.push_back(l);
+			}
+		}
+		for (auto const& rest: {std::cref(small), std::cref(large)}) { // Full columns
+			for (std::uint32_t i: rest.get()) {
+				thresholds[i] = total;
+				aliases[i] = i;
+			}
+		}
+		return total;
+	};
+
+	void transitionTable::buildAliases() {
+		thresholds.resize(nexts.size());
+		aliases.resize(nexts.size());
+		cumulative.assign(offsets.size(), 0);
+		aliasBuilder builder;
+		for (std::uint32_t ctx = 0; ctx + 1 < offsets.size(); ++ctx) {
+			std::uint64_t from = offsets[ctx];
+			cumulative[ctx + 1] = cumulative[ctx] + builder.build(counts.data() + from, offsets[ctx + 1] - from, thresholds.data() + from, aliases.data() + from);
+		}
+	};
+
+	std::uintmax_t transitionTable::memory() const {
+		return offsets.capacity() * sizeof(std::uint64_t) + nexts.capacity() * sizeof(tokenId) + counts.capacity() * sizeof(std::uint64_t)
+			+ thresholds.capacity() * sizeof(std::uint64_t) + aliases.capacity() * sizeof(std::uint32_t) + cumulative.capacity() * sizeof(std::uint64_t)
+			+ successors.capacity() * sizeof(std::uint32_t);
+	};
+
+	modelView model::view() const {
+		if (mapping) {
+			return mapped;
+		}
+		return {tokens.view(), contexts.view(), transitions.view(), tokens.find("\n")};
+	};
+
+	void model::compile() {
+		if (mapping) {
+			return; // Cache is written compiled
+		}
+		// Numbers depend on order in which counts were collected (jobs, chunks, merges), and alias tables depend on order of transitions.
+		// So model is renumbered first: tokens by strings, contexts by hash of their strings (then by key), transitions of context by token.
+		// Then outputs for the same seed are the same for any `--jobs`, and layout is the same as `writeRuns` makes.
+		unsigned int n = contexts.getOrder();
+		tokenView tv = tokens.view();
+		std::vector<tokenId> sorted(tv.count);
+		std::iota(sorted.begin(), sorted.end(), 0);
+		std::sort(sorted.begin(), sorted.end(), [&tv](tokenId a, tokenId b) { return tv.str(a) < tv.str(b); }); // Empty string (endToken) stays first
+		tokenTable canonTokens;
+		std::vector<tokenId> rank(tv.count);
+		for (tokenId id: sorted) {
+			rank[id] = canonTokens.intern(tv.str(id));
+		}
+		std::vector<tokenId>().swap(sorted);
+		contextView cv = contexts.view();
+		std::vector<tokenId> keys(std::size_t(cv.count) * n);
+		for (std::size_t i = 0; i < keys.size(); ++i) {
+			keys[i] = rank[cv.keys[i]];
+		}
+		std::vector<std::pair<std::uint64_t, std::uint32_t>> byHash(cv.count); // Hash of strings and old number of context
+		for (std::uint32_t ctx = 0; ctx < cv.count; ++ctx) {
+			byHash[ctx] = {stringHash(canonTokens.stringHashes(), &keys[std::size_t(ctx) * n], n), ctx};
+		}
+		std::sort(byHash.begin(), byHash.end(), [&keys, n](auto const& a, auto const& b) {
+			if (a.first != b.first) {
+				return a.first < b.first;
+			}
+			const tokenId* ka = &keys[std::size_t(a.second) * n];
+			const tokenId* kb = &keys[std::size_t(b.second) * n];
+			return std::lexicographical_compare(ka, ka + n, kb, kb + n);
+		});
+		contextTable canonContexts(n);
+		canonContexts.reserve(cv.count); // Inserted in order without rehashing, so index is the same as filled by `writeRuns`
+		transitionView t = transitions.view();
+		std::vector<std::uint64_t> offsets{0};
+		std::vector<tokenId> nexts;
+		std::vector<std::uint64_t> counts;
+		nexts.reserve(t.size);
+		counts.reserve(t.size);
+		std::vector<std::pair<tokenId, std::uint64_t>> row;
+		for (auto const& entry: byHash) {
+			const tokenId* key = &keys[std::size_t(entry.second) * n];
+			canonContexts.insert(key, hashKey(key, n));
+			row.clear();
+			for (std::uint64_t i = t.begin(entry.second); i < t.end(entry.second); ++i) {
+				row.emplace_back(rank[t.nexts[i]], t.counts[i]);
+			}
+			std::sort(row.begin(), row.end());
+			for (auto const& [next, count]: row) {
+				nexts.push_back(next);
+				counts.push_back(count);
+			}
+			offsets.push_back(nexts.size());
+		}
+		tokens = std::move(canonTokens);
+		contexts = std::move(canonContexts);
+		transitions.build(std::move(offsets), std::move(nexts), std::move(counts));
+		transitions.compile(contexts.view());
+	};
+
+	std::uintmax_t model::memory() const {
+		return tokens.memory() + contexts.memory() + transitions.memory() + (mapping ? mappedBytes : 0);
+	};
+
+	modelBuilder::modelBuilder(model&& base): m(base.order()) {
+		if (base.mapping) { // Tables are in read-only file, so counts are copied from it
+			merge(base);
+			return;
+		}
+		m = std::move(base);
+		m.compileOnce = std::make_shared<std::once_flag>(); // Counts change, so it may be compiled again
+		transitionView t = m.transitions.view();
+		for (std::uint32_t ctx = 0; ctx < m.contexts.size(); ++ctx) {
+			for (std::uint64_t i = t.begin(ctx); i < t.end(ctx); ++i) {
+				counts.add(ctx, t.nexts[i], t.counts[i]);
+			}
+		}
+		m.transitions = transitionTable();
+	};
+
+	void modelBuilder::add(const tokenId* key, std::uint64_t hash, tokenId next) {
+		counts.add(m.contexts.insert(key, hash), next);
+		if (spillLimit != 0 and (++sinceCheck & 0xffff) == 0 and memory() > spillLimit) {
+			spilled += counts.total();
+			model part = finish();
+			m.tokens = part.tokens; // Caller keeps numbers of tokens (in its context window)
+			spill(std::move(part));
+		}
+	};
+
+	void modelBuilder::spillAt(std::uintmax_t limit, std::function<void(model&&)> func) {
+		spillLimit = limit;
+		spill = std::move(func);
+	};
+
+	void modelBuilder::merge(model const& other) {
+		if (other.order() != m.contexts.getOrder()) {
+			throw std::invalid_argument("can't merge models of different N");
+		}
+		modelView o = other.view();
+		// Numbers of tokens differ between models, so they are translated through strings once
+		std::vector<tokenId> remap(o.tokens.count);
+		for (tokenId id = 0; id < o.tokens.count; ++id) {
+			remap[id] = m.tokens.intern(o.tokens.str(id));
+		}
+		unsigned int order = m.contexts.getOrder();
+		m.contexts.reserve(m.contexts.size() + o.contexts.count);
+		MarkovContext key(order);
+		for (std::uint32_t ctx = 0; ctx < o.contexts.count; ++ctx) {
+			const tokenId* otherKey = o.contexts.key(ctx);
+			for (unsigned int i = 0; i < order; ++i) {
+				key[i] = remap[otherKey[i]];
+			}
+			std::uint32_t to = m.contexts.insert(key.data(), hashKey(key.data(), order));
+			for (std::uint64_t i = o.transitions.begin(ctx); i < o.transitions.end(ctx); ++i) {
+				counts.add(to, remap[o.transitions.nexts[i]], o.transitions.counts[i]);
+			}
+		}
+	};
+
+	model modelBuilder::finish() {
+		m.transitions.build(m.contexts.size(), counts);
+		counts = transitionCounter();
+		model res = std::move(m);
+		m = model(res.contexts.getOrder());
+		return res;
+	};
+}
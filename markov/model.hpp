@@ -0,0 +1,302 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <string_view>
+#include <vector>
+
+#include <generatorRandom.hpp>
+
+
+// Model of in-memory backend: every distinct token is stored once and referred by number (tokenId),
+// contexts are fixed-width arrays of N numbers kept in open addressing table, and tokens seen after every context
+// are stored once with their counts. Training and merging collect counts in modelBuilder, it makes final model.
+
+namespace markov {
+	using tokenId = std::uint32_t;
+	const tokenId endToken = 0; // Empty string: padding of start context and end of text
+	using MarkovContext = std::vector<tokenId>; // Last N tokens, oldest first
+
+	// Hash of context is polynomial over mixed token numbers, so it can be rolled when window moves by one token
+	const std::uint64_t hashBase = 0x100000001b3ULL; // Odd multiplier
+
+	inline std::uint64_t tokenMix(tokenId id) { // Spread small numbers over all bits (splitmix64 finalizer)
+		std::uint64_t x = id + 0x9e3779b97f4a7c15ULL;
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+		return x ^ (x >> 31);
+	}
+
+	inline std::uint64_t hashKey(const tokenId* key, unsigned int order) {
+		std::uint64_t hash = 0;
+		for (unsigned int i = 0; i < order; ++i) {
+			hash = hash * hashBase + tokenMix(key[i]);
+		}
+		return hash;
+	}
+
+	std::uint64_t stringHash(const std::uint64_t* tokenHashes, const tokenId* key, unsigned int order); // Hash of context from hashes of its strings: the same for any numbering of tokens
+
+	const unsigned int anyOrder = 0; // Order of window chosen at runtime
+
+	std::size_t slotsFor(std::size_t count); // Slots of open addressing table for count of entries: power of 2 with load factor at most 3/4
+
+	template<unsigned int Order>
+	class contextWindow { // Last N tokens as ring in doubled array (every token is written twice), so window is always contiguous and its hash is rolled
+		public:
+			explicit contextWindow(unsigned int order = Order): order(Order == anyOrder ? order : Order) {
+				if constexpr (Order == anyOrder) {
+					buf.resize(2 * order);
+				}
+				top = 1;
+				for (unsigned int i = 1; i < size(); ++i) {
+					top *= hashBase;
+				}
+				reset();
+			};
+
+			unsigned int size() const { return Order == anyOrder ? order : Order; };
+			const tokenId* data() const { return buf.data() + head; };
+			std::uint64_t hash() const { return h; };
+
+			void reset() { // All empty, as at the start
+				std::fill(buf.begin(), buf.end(), endToken);
+				head = 0;
+				h = hashKey(data(), size());
+			};
+			void assign(const tokenId* key) {
+				std::copy(key, key + size(), buf.begin());
+				std::copy(key, key + size(), buf.begin() + size());
+				head = 0;
+				h = hashKey(data(), size());
+			};
+			void push(tokenId id) { // Oldest goes away
+				if (size() == 0) {
+					return;
+				}
+				h = (h - tokenMix(buf[head]) * top) * hashBase + tokenMix(id);
+				buf[head] = buf[head + size()] = id;
+				head = head + 1 == size() ? 0 : head + 1;
+			};
+
+		private:
+			unsigned int order;
+			std::conditional_t<Order == anyOrder, std::vector<tokenId>, std::array<tokenId, 2 * Order>> buf;
+			unsigned int head;
+			std::uint64_t h;
+			std::uint64_t top; // hashBase ^ (N - 1), weight of oldest token
+	};
+
+	// Read-only views of final model: generation works through them, so model may be owned or mapped from cache file in place
+
+	struct tokenView {
+		const char* pool; // All strings one after another
+		const std::uint64_t* starts; // String i is [starts[i], starts[i + 1]) of pool
+		std::uint32_t count;
+
+		std::string_view str(tokenId id) const { return std::string_view(pool + starts[id], starts[id + 1] - starts[id]); };
+	};
+
+	struct contextView {
+		unsigned int order;
+		std::uint32_t count;
+		const tokenId* keys; // Context number i is [i * order, (i + 1) * order)
+		const std::uint64_t* hashes;
+		const std::uint32_t* slots; // Open addressing (linear probing): number of context + 1, 0 is empty
+		std::uint64_t slotCount; // Power of 2
+		unsigned int shift; // 64 - log2(slotCount)
+
+		static constexpr std::uint32_t none = ~std::uint32_t(0);
+		std::size_t slot(std::uint64_t hash) const { return (hash * 0x9e3779b97f4a7c15ULL) >> shift; }; // Fibonacci hashing: high bits are mixed best
+		const tokenId* key(std::uint32_t ctx) const { return keys + std::size_t(ctx) * order; };
+		std::uint32_t find(const tokenId* key, std::uint64_t hash) const; // Number of context or `none`
+	};
+
+	struct transitionView {
+		const std::uint64_t* offsets; // Context i owns [offsets[i], offsets[i + 1])
+		const tokenId* nexts;
+		const std::uint64_t* counts;
+		const std::uint64_t* thresholds; // Column i gives own token if uniform(total of context) is below this
+		const std::uint32_t* aliases; // Otherwise token of this column (inside context)
+		const std::uint64_t* cumulative; // Sum of counts of contexts before every context and after the last one: context i has cumulative[i + 1] - cumulative[i]
+		const std::uint32_t* successors; // Context after every transition (window moved by its token) or `contextView::none`
+		std::uint64_t size; // Distinct transitions
+
+		std::uint64_t begin(std::uint32_t ctx) const { return offsets[ctx]; }; // Transitions of context are [begin, end)
+		std::uint64_t end(std::uint32_t ctx) const { return offsets[ctx + 1]; };
+		std::uint64_t pick(std::uint32_t ctx, generatorRandom& gen) const { // Transition with probability count / total of context
+			std::uint64_t from = offsets[ctx], k = offsets[ctx + 1] - from;
+			if (k == 1) { return from; } // Only one choice, no randomness needed
+			std::uint64_t column = gen.uniform(k);
+			return gen.uniform(cumulative[ctx + 1] - cumulative[ctx]) < thresholds[from + column] ? from + column : from + aliases[from + column];
+		};
+		std::uint32_t occurrence(std::uint32_t contexts, generatorRandom& gen) const { // Context with probability of its occurrence in text; argument: count of contexts
+			const std::uint64_t* at = std::upper_bound(cumulative, cumulative + contexts + 1, gen.uniform(cumulative[contexts]));
+			return at - cumulative - 1;
+		};
+	};
+
+	struct modelView {
+		tokenView tokens;
+		contextView contexts;
+		transitionView transitions;
+		tokenId newline; // Written without prefixmiddle, ~0 if there is none
+	};
+
+	// Contexts are states of automaton: successor of every transition is found once here, so generation follows numbers and never hashes
+	void compileSuccessors(contextView const& contexts, transitionView const& transitions, std::uint32_t* successors); // Fills `transitions.size` successors
+
+	class tokenTable { // Interning: string <-> number
+		public:
+			tokenTable();
+			tokenId intern(std::string_view str); // Number of string, added if new
+			tokenId find(std::string_view str) const; // Number of string or `none`
+			std::string_view str(tokenId id) const { return view().str(id); };
+			const std::uint64_t* stringHashes() const { return hashes.data(); }; // std::hash of every string
+			std::size_t size() const { return hashes.size(); };
+			tokenView view() const { return {pool.data(), starts.data(), std::uint32_t(size())}; };
+			std::uintmax_t memory() const; // Approximate, in bytes
+
+			static constexpr tokenId none = ~tokenId(0);
+
+		private:
+			void rehash(std::size_t count); // Count of slots, power of 2
+			std::size_t slot(std::uint64_t hash) const { return hash & (slots.size() - 1); };
+
+			std::string pool;
+			std::vector<std::uint64_t> starts{0};
+			std::vector<std::uint64_t> hashes; // Of every string
+			std::vector<tokenId> slots; // Open addressing (linear probing) index, `none` is empty
+	};
+
+	class contextTable { // Context (N token numbers) -> its number
+		public:
+			explicit contextTable(unsigned int order = 0): order(order) {};
+
+			std::uint32_t find(const tokenId* key, std::uint64_t hash) const { return view().find(key, hash); }; // Number of context or `none`
+			std::uint32_t insert(const tokenId* key, std::uint64_t hash); // Number of context, added if new
+			void reserve(std::size_t count); // Of contexts
+
+			unsigned int getOrder() const { return order; };
+			std::uint32_t size() const { return hashes.size(); }; // Count of contexts, they are numbered from 0
+			contextView view() const { return {order, size(), keys.data(), hashes.data(), slots.data(), slots.size(), shift}; };
+			std::uintmax_t memory() const; // Approximate, in bytes
+
+			static constexpr std::uint32_t none = contextView::none;
+
+		private:
+			void rehash(std::size_t count); // Count of slots, power of 2
+			std::size_t slot(std::uint64_t hash) const { return view().slot(hash); };
+			const tokenId* key(std::uint32_t ctx) const { return keys.data() + std::size_t(ctx) * order; };
+			bool equal(std::uint32_t ctx, const tokenId* key) const;
+
+			unsigned int order;
+			std::vector<tokenId> keys;
+			std::vector<std::uint64_t> hashes;
+			std::vector<std::uint32_t> slots; // Number of context + 1, 0 is empty
+			unsigned int shift = 64;
+	};
+
+	class transitionCounter { // While training: (context, token after it) -> count
+		public:
+			void add(std::uint32_t ctx, tokenId next, std::uint64_t count = 1);
+			std::size_t size() const { return used; }; // Distinct pairs
+			std::uintmax_t total() const { return sum; };
+			std::uintmax_t memory() const { return slots.capacity() * sizeof(entry); };
+			template<typename Func> void forEach(Func func) const { // Arguments of func: context, token, count
+				for (auto const& e: slots) {
+					if (e.count != 0) {
+						func(std::uint32_t(e.key >> 32), tokenId(e.key), e.count);
+					}
+				}
+			};
+
+		private:
+			struct entry {
+				std::uint64_t key; // Context in high half, token in low one
+				std::uint64_t count; // 0 is empty slot
+			};
+			void rehash(std::size_t count);
+			std::size_t slot(std::uint64_t key) const { return (key * 0x9e3779b97f4a7c15ULL) >> shift; };
+
+			std::vector<entry> slots; // Open addressing (linear probing)
+			std::size_t used = 0;
+			unsigned int shift = 64;
+			std::uintmax_t sum = 0;
+	};
+
+	class aliasBuilder { // Alias table (Vose) of one context; keeps scratch space between calls
+		public:
+			std::uint64_t build(const std::uint64_t* counts, std::uint64_t k, std::uint64_t* thresholds, std::uint32_t* aliases); // Arguments: k counts, k thresholds and aliases to fill; returns total
+
+		private:
+			std::vector<std::uint32_t> small, large;
+			std::vector<unsigned __int128> scaled;
+	};
+
+	class transitionTable { // Final: tokens after every context with counts, alias table (Vose), so sampling is O(1), and successors
+		public:
+			void build(std::uint32_t contexts, transitionCounter const& counter);
+			void build(std::vector<std::uint64_t> offsets, std::vector<tokenId> nexts, std::vector<std::uint64_t> counts); // Laid out already
+			void compile(contextView const& contexts); // Successors, needed only for generation and saving
+			bool compiled() const { return successors.size() == nexts.size(); };
+			transitionView view() const { return {offsets.data(), nexts.data(), counts.data(), thresholds.data(), aliases.data(), cumulative.data(), successors.data(), nexts.size()}; };
+			std::uintmax_t memory() const;
+
+		private:
+			void buildAliases(); // And cumulative totals, from offsets and counts
+
+			std::vector<std::uint64_t> offsets;
+			std::vector<tokenId> nexts;
+			std::vector<std::uint64_t> counts;
+			std::vector<std::uint64_t> thresholds;
+			std::vector<std::uint32_t> aliases;
+			std::vector<std::uint64_t> cumulative;
+			std::vector<std::uint32_t> successors;
+	};
+
+	struct model { // Value passed through boost::any
+		explicit model(unsigned int order = 0): contexts(order) {};
+		tokenTable tokens;
+		contextTable contexts;
+		transitionTable transitions;
+		std::shared_ptr<const void> mapping; // Set if model is used in place from mapped cache file, then tables above are empty
+		modelView mapped; // Its view
+		std::uintmax_t mappedBytes = 0;
+		std::shared_ptr<std::once_flag> compileOnce = std::make_shared<std::once_flag>(); // Outputs may start in many threads, only first one compiles
+
+		modelView view() const; // Cheap, but keep it for whole output
+		unsigned int order() const { return mapping ? mapped.contexts.order : contexts.getOrder(); };
+		std::uint32_t size() const { return mapping ? mapped.contexts.count : contexts.size(); }; // Count of contexts
+		std::uintmax_t memory() const; // Approximate, in bytes (mapped file is counted whole)
+		bool compiled() const { return mapping or transitions.compiled(); }; // Mapped one always is
+		void compile(); // Canonical numbering and successors; once, only for model that is used: intermediate results of training are never compiled
+	};
+
+	class modelBuilder { // Collects counts while training or merging
+		public:
+			explicit modelBuilder(unsigned int order): m(order) {};
+			explicit modelBuilder(model&& base); // Continue counting from finished model
+			tokenId intern(std::string_view str) { return m.tokens.intern(str); };
+			void add(const tokenId* key, std::uint64_t hash, tokenId next); // Arguments: context (N tokens), its hash, token seen after it
+			void merge(model const& other); // Add all counts of other
+			model finish(); // Builder is empty after it
+			std::uintmax_t total() const { return counts.total() + spilled; }; // Tokens counted (spilled ones too)
+			std::uintmax_t memory() const { return m.memory() + counts.memory(); };
+			void spillAt(std::uintmax_t limit, std::function<void(model&&)> func); // While adding, give finished model to func whenever memory exceeds limit
+
+		private:
+			model m; // Tokens and contexts, transitions are built by `finish`
+			transitionCounter counts;
+			std::uintmax_t spillLimit = 0;
+			std::function<void(model&&)> spill;
+			std::uint64_t sinceCheck = 0;
+			std::uintmax_t spilled = 0;
+	};
+}
@@ -0,0 +1,91 @@
+#include "shared.hpp"
+
+namespace markov {
+	static const std::size_t batchSize = 1024; // Additions passed to shard under one lock
+
+	sharedBuilder::sharedBuilder(unsigned int order, std::size_t count): order(order) {
+		for (std::size_t i = 0; i < count; ++i) {
+			shards.push_back(std::make_unique<shard>());
+			shards.back()->contexts = contextTable(order);
+		}
+	};
+
+	tokenId sharedBuilder::intern(std::string_view str) {
+		{
+			std::shared_lock<std::shared_mutex> lock(tokensMutex); // Most tokens are known already
+			tokenId id = tokens.find(str);
+			if (id != tokenTable::none) {
+				return id;
+			}
+		}
+		std::unique_lock<std::shared_mutex> lock(tokensMutex);
+		return tokens.intern(str);
+	};
+
+	model sharedBuilder::finish() {
+		// Every context is in one shard only, so shards are only put together: contexts are renumbered, tokens keep numbers
+		model m(order);
+		m.tokens = std::move(tokens);
+		tokens = tokenTable();
+		std::size_t count = 0;
+		for (auto const& s: shards) {
+			count += s->contexts.size();
+		}
+		m.contexts.reserve(count);
+		transitionCounter counts;
+		std::vector<std::uint32_t> renumber;
+		for (auto& s: shards) {
+			contextView v = s->contexts.view();
+			renumber.resize(v.count);
+			for (std::uint32_t ctx = 0; ctx < v.count; ++ctx) {
+				renumber[ctx] = m.contexts.insert(v.key(ctx), v.hashes[ctx]);
+			}
+			s->counts.forEach([&counts, &renumber](std::uint32_t ctx, tokenId next, std::uint64_t n) { counts.add(renumber[ctx], next, n); });
+			s->contexts = contextTable(order); // Free it right now
+			s->counts = transitionCounter();
+		}
+		m.transitions.build(m.contexts.size(), counts);
+		return m;
+	};
+
+	sharedBuilder::writer::writer(sharedBuilder& to): to(to), global{endToken}, pending(to.shards.size()), pendingHashes(to.shards.size()) { };
+
+	tokenId sharedBuilder::writer::intern(std::string_view str) {
+		tokenId id = local.intern(str);
+		if (id == global.size()) { // New for this job
+			global.push_back(to.intern(str));
+		}
+		return global[id];
+	};
+
+	void sharedBuilder::writer::add(const tokenId* key, std::uint64_t hash, tokenId next) {
+		std::size_t s = hash & (to.shards.size() - 1);
+		pending[s].insert(pending[s].end(), key, key + to.order);
+		pending[s].push_back(next);
+		pendingHashes[s].push_back(hash);
+		++sum;
+		if (pendingHashes[s].size() == batchSize) {
+			flush(s);
+		}
+	};
+
+	void sharedBuilder::writer::flush(std::size_t s) {
+		shard& target = *to.shards[s];
+		std::size_t width = to.order + 1;
+		{
+			std::lock_guard<std::mutex> lock(target.mutex);
+			for (std::size_t i = 0; i < pendingHashes[s].size(); ++i) {
+				const tokenId* rec = pending[s].data() + i * width;
+				target.counts.add(target.contexts.insert(rec, pendingHashes[s][i]), rec[width - 1]);
+			}
+		}
+		pending[s].clear();
+		pendingHashes[s].clear();
+	};
+
+	void sharedBuilder::writer::flush() {
+		for (std::size_t s = 0; s < pending.size(); ++s) {
+			flush(s);
+		}
+	};
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "model.hpp"
+
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <vector>
+
+// Shared-state training: all jobs count into one table instead of own models, so common contexts are stored once and there is nothing to merge.
+// Tokens are interned under reader-writer lock (jobs cache their numbers), contexts go to shards chosen by hash, each under own lock.
+
+namespace markov {
+	class sharedBuilder {
+		public:
+			sharedBuilder(unsigned int order, std::size_t shards); // Count of shards is power of 2
+
+			class writer { // Used by one job: caches numbers of tokens and passes contexts to shards by batches
+				public:
+					explicit writer(sharedBuilder& to);
+					tokenId intern(std::string_view str);
+					void add(const tokenId* key, std::uint64_t hash, tokenId next);
+					void flush(); // Call at the end of job
+					std::uintmax_t total() const { return sum; };
+
+				private:
+					void flush(std::size_t shard);
+
+					sharedBuilder& to;
+					tokenTable local; // Tokens seen by this job
+					std::vector<tokenId> global; // Their shared numbers
+					std::vector<std::vector<tokenId>> pending; // For every shard: context and next token of additions not passed yet
+					std::vector<std::vector<std::uint64_t>> pendingHashes;
+					std::uintmax_t sum = 0;
+			};
+
+			model finish(); // After all writers are flushed; builder is empty after it
+
+		private:
+			struct shard {
+				std::mutex mutex;
+				contextTable contexts;
+				transitionCounter counts;
+			};
+
+			tokenId intern(std::string_view str);
+
+			unsigned int order;
+			std::shared_mutex tokensMutex;
+			tokenTable tokens;
+			std::vector<std::unique_ptr<shard>> shards;
+	};
+}
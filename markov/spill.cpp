@@ -0,0 +1,316 @@
+#include "spill.hpp"
+#include "cache.hpp"
+
+#include <fstream>
+#include <functional>
+#include <numeric>
+#include <queue>
+#include <stdexcept>
+
+#include <boost/filesystem/operations.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+namespace markov {
+	namespace bip = boost::interprocess;
+
+	// Run file: header, tokens of run (pool and starts, as in cache), then records sorted by `hash`.
+	// Numbers of tokens are local to run; hash is computed from strings, so the same context has the same hash in every run.
+	struct runHeader {
+		std::uint32_t order;
+		std::uint32_t tokens;
+		std::uint64_t poolBytes;
+		std::uint64_t records;
+	};
+	// Record: hash of context (std::uint64_t), context (N tokenId), next token (tokenId), count (std::uint64_t)
+
+	static const std::size_t streamBuffer = 1 << 18; // Of every run and section file
+
+	static std::string tempName(std::string const& dir, std::string const& pattern) {
+		return (boost::filesystem::path(dir) / boost::filesystem::unique_path(pattern)).string();
+	}
+
+	spillRun::~spillRun() {
+		boost::system::error_code ec; // Never throw from here
+		boost::filesystem::remove(fname, ec);
+	};
+
+	std::shared_ptr<spillRun> spillRun::write(modelView const& m, std::string const& dir) {
+		std::shared_ptr<spillRun> res(new spillRun(tempName(dir, "markov-%%%%-%%%%-%%%%-%%%%.run"))); // File is removed if writing fails
+		unsigned int order = m.contexts.order;
+		std::vector<std::uint64_t> tokenHashes(m.tokens.count);
+		for (tokenId id = 0; id < m.tokens.count; ++id) {
+			tokenHashes[id] = std::hash<std::string_view>()(m.tokens.str(id));
+		}
+		std::vector<std::pair<std::uint64_t, std::uint32_t>> sorted(m.contexts.count); // Hash and number of context
+		for (std::uint32_t ctx = 0; ctx < m.contexts.count; ++ctx) {
+			sorted[ctx] = {stringHash(tokenHashes.data(), m.contexts.key(ctx), order), ctx};
+		}
+		std::sort(sorted.begin(), sorted.end());
+
+		std::vector<char> buf(streamBuffer);
+		std::ofstream file;
+		file.exceptions ( std::ofstream::failbit | std::ofstream::badbit );
+		file.rdbuf()->pubsetbuf(buf.data(), buf.size());
+		file.open(res->path(), std::ofstream::trunc | std::ofstream::binary);
+		runHeader h = {order, m.tokens.count, m.tokens.starts[m.tokens.count], m.transitions.size};
+		file.write(reinterpret_cast<const char*>(&h), sizeof(h));
+		file.write(m.tokens.pool, h.poolBytes);
+		file.write(reinterpret_cast<const char*>(m.tokens.starts), (std::uint64_t(h.tokens) + 1) * sizeof(std::uint64_t));
+		for (auto const& [hash, ctx]: sorted) {
+			for (std::uint64_t i = m.transitions.begin(ctx); i < m.transitions.end(ctx); ++i) {
+				file.write(reinterpret_cast<const char*>(&hash), sizeof(hash));
+				file.write(reinterpret_cast<const char*>(m.contexts.key(ctx)), order * sizeof(tokenId));
+				file.write(reinterpret_cast<const char*>(&m.transitions.nexts[i]), sizeof(tokenId));
+				file.write(reinterpret_cast<const char*>(&m.transitions.counts[i]), sizeof(std::uint64_t));
+			}
+		}
+		file.close();
+		return res;
+	};
+
+	class runReader { // Records of one run, by one
+		public:
+			runReader(std::string const& fname, unsigned int order): key(order), buf(streamBuffer) {
+				file.exceptions ( std::ifstream::failbit | std::ifstream::badbit );
+				file.rdbuf()->pubsetbuf(buf.data(), buf.size());
+				file.open(fname, std::ifstream::binary);
+				runHeader h;
+				file.read(reinterpret_cast<char*>(&h), sizeof(h));
+				if (h.order != order) {
+					throw std::invalid_argument("run `" + fname + "` was made with other N");
+				}
+				left = h.records;
+				pool.resize(h.poolBytes);
+				starts.resize(std::uint64_t(h.tokens) + 1);
+				file.read(pool.data(), pool.size());
+				file.read(reinterpret_cast<char*>(starts.data()), starts.size() * sizeof(std::uint64_t));
+			};
+
+			std::uint32_t tokens() const { return starts.size() - 1; };
+			std::string_view str(tokenId id) const { return std::string_view(pool.data() + starts[id], starts[id + 1] - starts[id]); };
+			void dropTokens() { // They are not needed once remap is made
+				std::string().swap(pool);
+				std::vector<std::uint64_t>().swap(starts);
+			};
+
+			bool next() { // Read next record; false at the end
+				if (left == 0) {
+					return false;
+				}
+				--left;
+				file.read(reinterpret_cast<char*>(&hash), sizeof(hash));
+				file.read(reinterpret_cast<char*>(key.data()), key.size() * sizeof(tokenId));
+				file.read(reinterpret_cast<char*>(&nextToken), sizeof(nextToken));
+				file.read(reinterpret_cast<char*>(&count), sizeof(count));
+				return true;
+			};
+
+			std::vector<tokenId> remap; // Number of token in run -> number in merged cache
+			std::uint64_t hash;
+			std::vector<tokenId> key;
+			tokenId nextToken;
+			std::uint64_t count;
+
+		private:
+			std::vector<char> buf;
+			std::ifstream file;
+			std::uint64_t left;
+			std::string pool;
+			std::vector<std::uint64_t> starts;
+	};
+
+	class sectionFile { // One array of cache, written while runs are merged
+		public:
+			explicit sectionFile(std::string const& dir): buf(streamBuffer), fname(tempName(dir, "markov-%%%%-%%%%-%%%%-%%%%.section")) {
+				file.exceptions ( std::ofstream::failbit | std::ofstream::badbit );
+				file.rdbuf()->pubsetbuf(buf.data(), buf.size());
+				file.open(fname, std::ofstream::trunc | std::ofstream::binary);
+			};
+			~sectionFile() {
+				boost::system::error_code ec;
+				boost::filesystem::remove(fname, ec);
+			};
+
+			template<typename T> void write(const T* data, std::size_t count) { file.write(reinterpret_cast<const char*>(data), count * sizeof(T)); };
+			template<typename T> void write(T const& value) { write(&value, 1); };
+
+			void appendTo(std::ostream& out) { // Padded, as writeArray does
+				file.close();
+				std::ifstream in;
+				in.exceptions ( std::ifstream::badbit );
+				in.open(fname, std::ifstream::binary);
+				std::uint64_t bytes = 0;
+				while (in.read(buf.data(), buf.size()) or in.gcount() > 0) {
+					out.write(buf.data(), in.gcount());
+					bytes += in.gcount();
+				}
+				static const char zeros[8] = {};
+				out.write(zeros, (8 - bytes % 8) % 8);
+			};
+
+		private:
+			std::vector<char> buf;
+			std::string fname;
+			std::ofstream file;
+	};
+
+	void writeRuns(std::vector<std::shared_ptr<spillRun>> const& runs, unsigned int order, std::string const& fname, std::string const& dir) {
+		std::vector<std::unique_ptr<runReader>> readers;
+		for (auto const& run: runs) {
+			readers.push_back(std::make_unique<runReader>(run->path(), order));
+		}
+
+		// Tokens of all runs, numbered in order of strings: numbering does not depend on how corpus was split between jobs and runs
+		tokenTable all;
+		for (auto& r: readers) {
+			r->remap.resize(r->tokens());
+			for (tokenId id = 0; id < r->tokens(); ++id) {
+				r->remap[id] = all.intern(r->str(id));
+			}
+			r->dropTokens();
+		}
+		std::vector<tokenId> sorted(all.size());
+		std::iota(sorted.begin(), sorted.end(), 0);
+		std::sort(sorted.begin(), sorted.end(), [&all](tokenId a, tokenId b) { return all.str(a) < all.str(b); }); // Empty string (endToken) stays first
+		std::vector<tokenId> rank(all.size());
+		std::string pool;
+		std::vector<std::uint64_t> starts{0};
+		for (tokenId i = 0; i < sorted.size(); ++i) {
+			rank[sorted[i]] = i;
+			pool.append(all.str(sorted[i]));
+			starts.push_back(pool.size());
+		}
+		for (auto& r: readers) {
+			for (auto& id: r->remap) {
+				id = rank[id];
+			}
+		}
+		tokenId newline = all.find("\n") == tokenTable::none ? tokenTable::none : rank[all.find("\n")];
+		tokenId tokens = all.size();
+		all = tokenTable();
+		std::vector<tokenId>().swap(sorted);
+		std::vector<tokenId>().swap(rank);
+
+		// Records with the same hash come from all runs together; they are (almost always) one context, so they are sorted and summed in memory
+		sectionFile keys(dir), hashes(dir), offsets(dir), nexts(dir), counts(dir), thresholds(dir), aliases(dir), cumulative(dir);
+		auto later = [](runReader* a, runReader* b) { return a->hash > b->hash; };
+		std::priority_queue<runReader*, std::vector<runReader*>, decltype(later)> heap(later);
+		for (auto& r: readers) {
+			if (r->next()) {
+				heap.push(r.get());
+			}
+		}
+		std::uint64_t contexts = 0, transitions = 0, occurrences = 0;
+		std::vector<tokenId> group; // Records of group: context and next token
+		std::vector<std::uint64_t> groupCounts;
+		std::vector<std::uint32_t> index;
+		std::vector<tokenId> ctxNexts;
+		std::vector<std::uint64_t> ctxCounts, ctxThresholds;
+		std::vector<std::uint32_t> ctxAliases;
+		aliasBuilder alias;
+		auto flush = [&](const tokenId* key) { // Write context with collected transitions
+			if (contexts == contextTable::none) {
+				throw std::length_error("too many distinct contexts");
+			}
+			keys.write(key, order);
+			hashes.write(hashKey(key, order));
+			offsets.write(transitions);
+			cumulative.write(occurrences);
+			ctxThresholds.resize(ctxNexts.size());
+			ctxAliases.resize(ctxNexts.size());
+			occurrences += alias.build(ctxCounts.data(), ctxCounts.size(), ctxThresholds.data(), ctxAliases.data());
+			nexts.write(ctxNexts.data(), ctxNexts.size());
+			counts.write(ctxCounts.data(), ctxCounts.size());
+			thresholds.write(ctxThresholds.data(), ctxThresholds.size());
+			aliases.write(ctxAliases.data(), ctxAliases.size());
+			++contexts;
+			transitions += ctxNexts.size();
+			ctxNexts.clear();
+			ctxCounts.clear();
+		};
+		std::size_t width = order + 1;
+		while (!heap.empty()) {
+			std::uint64_t hash = heap.top()->hash;
+			group.clear();
+			groupCounts.clear();
+			while (!heap.empty() and heap.top()->hash == hash) {
+				runReader* r = heap.top();
+				heap.pop();
+				for (tokenId id: r->key) {
+					group.push_back(r->remap[id]);
+				}
+				group.push_back(r->remap[r->nextToken]);
+				groupCounts.push_back(r->count);
+				if (r->next()) {
+					heap.push(r);
+				}
+			}
+			index.resize(groupCounts.size());
+			std::iota(index.begin(), index.end(), 0);
+			std::sort(index.begin(), index.end(), [&group, width](std::uint32_t a, std::uint32_t b) {
+				return std::lexicographical_compare(&group[a * width], &group[a * width] + width, &group[b * width], &group[b * width] + width);
+			});
+			for (std::size_t i = 0; i < index.size(); ++i) {
+				const tokenId* rec = &group[index[i] * width];
+				if (!ctxNexts.empty() and ctxNexts.back() == rec[order]) { // Context is the same while there are collected transitions
+					ctxCounts.back() += groupCounts[index[i]]; // Same transition from other run
+				} else {
+					ctxNexts.push_back(rec[order]);
+					ctxCounts.push_back(groupCounts[index[i]]);
+				}
+				if (i + 1 == index.size() or !std::equal(rec, rec + order, &group[index[i + 1] * width])) {
+					flush(rec);
+				}
+			}
+		}
+		offsets.write(transitions);
+		cumulative.write(occurrences);
+
+		// Slots of context index and successors are filled last, in place: file is mapped, so they need no memory of their own
+		cacheHeader h = makeHeader(order, tokens, contexts, transitions, pool.size(), slotsFor(contexts), newline);
+		std::string tmpname = fname + ".tmp";
+		{
+			std::ofstream file;
+			file.exceptions ( std::ofstream::failbit | std::ofstream::badbit );
+			file.open(tmpname, std::ofstream::trunc | std::ofstream::binary);
+			file.write(reinterpret_cast<const char*>(&h), sizeof(h));
+			writeArray(file, pool.data(), pool.size());
+			writeArray(file, starts.data(), starts.size() * sizeof(std::uint64_t));
+			keys.appendTo(file);
+			hashes.appendTo(file);
+			std::vector<char> zeros(streamBuffer, 0);
+			auto reserve = [&file, &zeros](std::uint64_t bytes) {
+				for (std::uint64_t left = (bytes + 7) / 8 * 8; left > 0; left -= std::min<std::uint64_t>(left, zeros.size())) {
+					file.write(zeros.data(), std::min<std::uint64_t>(left, zeros.size()));
+				}
+			};
+			reserve(h.slotCount * sizeof(std::uint32_t));
+			for (auto section: {&offsets, &nexts, &counts, &thresholds, &aliases, &cumulative}) {
+				section->appendTo(file);
+			}
+			reserve(h.transitions * sizeof(std::uint32_t));
+			file.close();
+		}
+		{
+			bip::file_mapping mapping(tmpname.c_str(), bip::read_write);
+			bip::mapped_region region(mapping, bip::read_write);
+			char* base = static_cast<char*>(region.get_address());
+			cacheLayout l(h);
+			const std::uint64_t* ctxHashes = reinterpret_cast<const std::uint64_t*>(base + l.hashes);
+			std::uint32_t* slots = reinterpret_cast<std::uint32_t*>(base + l.slots);
+			contextView table = {order, std::uint32_t(contexts), reinterpret_cast<const tokenId*>(base + l.keys), ctxHashes, slots, h.slotCount, h.shift};
+			for (std::uint32_t ctx = 0; ctx < contexts; ++ctx) {
+				std::size_t i = table.slot(ctxHashes[ctx]);
+				while (slots[i] != 0) {
+					i = (i + 1) & (h.slotCount - 1);
+				}
+				slots[i] = ctx + 1;
+			}
+			transitionView t = {reinterpret_cast<const std::uint64_t*>(base + l.offsets), reinterpret_cast<const tokenId*>(base + l.nexts), nullptr, nullptr, nullptr, nullptr, nullptr, h.transitions};
+			compileSuccessors(table, t, reinterpret_cast<std::uint32_t*>(base + l.successors));
+			region.flush();
+		}
+		boost::filesystem::rename(tmpname, fname);
+	}
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "model.hpp"
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// External memory training: when model of job grows over limit, its counts are written to run file sorted by hash of context strings
+// and job goes on with empty model. Runs of all jobs are merged (k-way) straight into binary cache in one streaming pass,
+// so memory depends on the limit and the vocabulary, not on size of corpus.
+
+namespace markov {
+	class spillRun { // Run file, removed when last reference is dropped
+		public:
+			static std::shared_ptr<spillRun> write(modelView const& m, std::string const& dir);
+			~spillRun();
+			std::string const& path() const { return fname; };
+
+		private:
+			explicit spillRun(std::string fname): fname(std::move(fname)) {};
+			std::string fname;
+	};
+
+	struct spilledModel { // Value passed through boost::any instead of model once training spilled
+		explicit spilledModel(unsigned int order, std::vector<std::shared_ptr<spillRun>> runs = {}): order(order), runs(std::move(runs)) {};
+
+		unsigned int order;
+		std::vector<std::shared_ptr<spillRun>> runs;
+		std::shared_ptr<std::once_flag> once = std::make_shared<std::once_flag>(); // Model for generation is made on first use
+		std::shared_ptr<model> ready = std::make_shared<model>();
+	};
+
+	void writeRuns(std::vector<std::shared_ptr<spillRun>> const& runs, unsigned int order, std::string const& fname, std::string const& dir); // Merge into binary cache; arguments: runs, N, cache, directory for temporary files
+}
@@ -0,0 +1,14 @@
+# Truncated compressed input is reported as error of main code, not by abort of the whole process from pool thread.
+# Run by ctest with -DGENERATORS=... -DBACKEND=... -DCONFIG=... -DINPUT=... -DWORKDIR=...
+
+file(REMOVE_RECURSE ${WORKDIR})
+file(MAKE_DIRECTORY ${WORKDIR})
+file(WRITE ${WORKDIR}/good.txt "one two three\n\nfour five six\n") # Trained next to broken one
+execute_process(COMMAND ${GENERATORS} -b ${BACKEND} -p ${CONFIG} -j 2 -o ${WORKDIR}/out.txt ${WORKDIR}/good.txt ${INPUT}
+	RESULT_VARIABLE rc OUTPUT_QUIET ERROR_VARIABLE err)
+if (NOT rc STREQUAL "1")
+	message(FATAL_ERROR "expected exit code 1, got `${rc}`: ${err}")
+endif()
+if (NOT err MATCHES "Error in main code: unexpected end of gzip data")
+	message(FATAL_ERROR "error is not reported: ${err}")
+endif()
@@ -0,0 +1,33 @@
+# Both cache formats are loaded and give the same outputs as training on the same inputs: legacy text archive of `Hashtable`
+# (FIXTURES/legacy.cache, written from corpus.txt with CONFIG by the last build that had it) and current binary image.
+# Run by ctest with -DGENERATORS=... -DBACKEND=... -DCONFIG=... -DFIXTURES=... -DWORKDIR=...
+
+function(run)
+	execute_process(COMMAND ${ARGN} RESULT_VARIABLE rc OUTPUT_QUIET)
+	if (NOT rc EQUAL 0)
+		message(FATAL_ERROR "failed (${rc}): ${ARGN}")
+	endif()
+endfunction()
+
+file(REMOVE_RECURSE ${WORKDIR})
+file(MAKE_DIRECTORY ${WORKDIR})
+set(generate ${GENERATORS} -b ${BACKEND} -p ${CONFIG} -s 42 -n 20)
+run(${generate} -o ${WORKDIR}/trained.txt ${FIXTURES}/corpus.txt)
+run(${generate} -c w -f ${WORKDIR}/current.cache ${FIXTURES}/corpus.txt) # Exits once cache is saved
+file(SHA256 ${WORKDIR}/trained.txt reference)
+
+foreach(cache ${FIXTURES}/legacy.cache ${WORKDIR}/current.cache)
+	run(${generate} -o ${WORKDIR}/loaded.txt -c r -f ${cache})
+	file(SHA256 ${WORKDIR}/loaded.txt hash)
+	if (NOT hash STREQUAL reference)
+		message(FATAL_ERROR "outputs from ${cache} differ from trained model")
+	endif()
+endforeach()
+
+# Any other version is refused, not misread
+string(REPEAT "x" 256 padding)
+file(WRITE ${WORKDIR}/other.cache "markov-cache 4\n${padding}")
+execute_process(COMMAND ${generate} -o ${WORKDIR}/loaded.txt -c r -f ${WORKDIR}/other.cache RESULT_VARIABLE rc OUTPUT_QUIET ERROR_VARIABLE err)
+if (rc EQUAL 0 OR NOT err MATCHES "unsupported format version")
+	message(FATAL_ERROR "cache of other version is not refused (${rc}): ${err}")
+endif()
@@ -0,0 +1,29 @@
+# Same seed gives the same outputs for any --jobs and from run to run: final model is numbered canonically, whatever order merges finished in.
+# Run by ctest with -DGENERATORS=... -DBACKEND=... -DCORPUSGEN=... -DCONFIG=... -DWORKDIR=...
+
+function(run)
+	execute_process(COMMAND ${ARGN} RESULT_VARIABLE rc OUTPUT_QUIET)
+	if (NOT rc EQUAL 0)
+		message(FATAL_ERROR "failed (${rc}): ${ARGN}")
+	endif()
+endfunction()
+
+file(REMOVE_RECURSE ${WORKDIR})
+file(MAKE_DIRECTORY ${WORKDIR})
+run(${CORPUSGEN} -o ${WORKDIR}/corpus.txt -s 400000 --seed 1) # Split into 4 chunks at -j 4
+file(READ ${CONFIG} config)
+file(WRITE ${WORKDIR}/shared.conf "${config}\nshared=true\n")
+
+set(reference "")
+foreach(variant "1;${CONFIG}" "4;${CONFIG}" "1;${CONFIG}" "4;${CONFIG}" "4;${WORKDIR}/shared.conf")
+	list(GET variant 0 jobs)
+	list(GET variant 1 conf)
+	set(out ${WORKDIR}/out.txt)
+	run(${GENERATORS} -b ${BACKEND} -p ${conf} -j ${jobs} --chunk-size 100000 -s 42 -n 20 -o ${out} ${WORKDIR}/corpus.txt)
+	file(SHA256 ${out} hash)
+	if (reference STREQUAL "")
+		set(reference ${hash})
+	elseif (NOT hash STREQUAL reference)
+		message(FATAL_ERROR "-j ${jobs} with ${conf} gave other outputs for the same seed")
+	endif()
+endforeach()
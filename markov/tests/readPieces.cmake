@@ -0,0 +1,29 @@
+# Input read by pieces is split into the same tokens as whole mapped one, even if `iter` does not resynchronize by itself:
+# in text of letters only, "[a-z]{3}" gives other tokens if it starts from other position.
+# Run by ctest with -DGENERATORS=... -DBACKEND=... -DWORKDIR=...
+
+file(REMOVE_RECURSE ${WORKDIR})
+file(MAKE_DIRECTORY ${WORKDIR})
+string(RANDOM LENGTH 300000 ALPHABET abcdefgh RANDOM_SEED 3 corpus)
+file(WRITE ${WORKDIR}/corpus.txt "${corpus}")
+file(WRITE ${WORKDIR}/triples.conf "iter=\"[a-z]{3}\"\nprefixmiddle=\" \"\nN=2\nsplitstr=false\nmaxgen=60\n")
+
+set(reference "")
+foreach(buffer 0 1000 100000) # 0: mapped at once; pieces longer than lookback of readBlocks too
+	if (buffer EQUAL 0)
+		set(read --mmap-min 1)
+	else()
+		set(read --mmap-min 100000000 --buffer-size ${buffer})
+	endif()
+	execute_process(COMMAND ${GENERATORS} -b ${BACKEND} -p ${WORKDIR}/triples.conf ${read} -s 7 -n 30 -o ${WORKDIR}/out.txt ${WORKDIR}/corpus.txt
+		RESULT_VARIABLE rc OUTPUT_QUIET)
+	if (NOT rc EQUAL 0)
+		message(FATAL_ERROR "failed (${rc}) with buffer ${buffer}")
+	endif()
+	file(SHA256 ${WORKDIR}/out.txt hash)
+	if (reference STREQUAL "")
+		set(reference ${hash})
+	elseif (NOT hash STREQUAL reference)
+		message(FATAL_ERROR "input read by ${buffer} bytes gave other outputs than mapped one")
+	endif()
+endforeach()
@@ -20,28 +20,44 @@ namespace markov {
 	using MarkovDeque = std::deque<rowid_t>;
 	template<typename T>
 	void shiftDeque(std::deque<T>&, T&);
+	class markovBackend;
+	class markovState: public generatorState { // Walk through table by queries on main connection
+		public:
+			markovState(markovBackend& backend, sqlite::database& db, const std::string& query, std::uint64_t seed): backend(backend), db(db), pstm(db << query), gen(seed) {};
+			~markovState();
+			markovBackend& backend;
+			sqlite::database& db;
+			sqlite::database_binder pstm;
+			generatorRandom gen;
+			MarkovDeque dq;
+			unsigned long long int n = 0; // Tokens given
+			bool done = false;
+		};
 	class markovBackend: public generatorAPI { // We store most info inside SQL or class
 		public:
 			void init(std::vector<std::string>);
-			void trainBegin(std::vector<std::shared_ptr<std::ifstream>>);
-			boost::any train(std::shared_ptr<std::ifstream>);
+			void trainBegin(std::vector<std::shared_ptr<generatorInput>>);
+			boost::any train(std::shared_ptr<generatorInput>);
 			boost::any merge(std::vector<boost::any>&);
 			void out(boost::any&, std::shared_ptr<std::ostream>);
+			std::unique_ptr<generatorState> outBegin(boost::any&, std::uint64_t);
+			bool outNext(generatorState&, std::string&);
 
 			boost::any load(std::string);
 			void save(std::string fname, boost::any& data);
 
 		private:
 			std::mutex mutex;
-			void trainFile(std::shared_ptr<std::ifstream>, std::function<void(const std::string&, const bool&)>);
-			void trainPart(const std::string&, std::function<void(const std::string&, const bool&)>);
-			void trainFinal(const std::string&, std::function<void(const std::string&, const bool&)>);
+			void trainFile(std::shared_ptr<generatorInput>, std::function<void(const std::string&, const bool&)>);
+			void trainPart(const char*, const char*, std::function<void(const std::string&, const bool&)>);
+			void trainLines(const char*, const char*, std::function<void(const std::string&, const bool&)>);
+			void trainFinal(const char*, const char*, std::function<void(const std::string&, const bool&)>);
 			void trainInsert(const std::string&, sqlite::database, sqlite::database_binder&, MarkovDeque&);
 
 			std::unique_ptr<sqlite::database> connect();
 			std::unique_ptr<sqlite::database> mainConnection;
 
-			rowid_t outGet(sqlite::database_binder&, MarkovDeque&);
+			rowid_t outGet(sqlite::database_binder&, MarkovDeque&, generatorRandom&);
 
 			std::string iter;
 			std::string prefixmiddle;
@@ -51,8 +67,8 @@ namespace markov {
 			bool rndstart;
 			boost::regex separator;
 
-			boost::sregex_token_iterator xInvalidTokenIt;
-			boost::sregex_iterator xInvalidIt;
+			boost::cregex_token_iterator xInvalidTokenIt;
+			boost::cregex_iterator xInvalidIt;
 
 			std::string database_uri; // By default, use in-memory database
 			std::string sqlite_table;
@@ -1,4 +1,5 @@
 #include "interface.hpp"
+#include <inputBlocks.hpp>
 #include <streambuf>
 #include <algorithm>
 #include <boost/dll/alias.hpp>
@@ -193,10 +194,12 @@ namespace markov {
 			std::vector<std::string> vec;
 			std::vector<std::string> vec2 = {"rstr"};
 			for (int i = 1; i <= N; i++) {
-					vec.push_back("str"+std::to_string(i)+"=?"); // All "base" strings
+					vec.push_back("str"+std::to_string(i)+"=?"+std::to_string(i)); // All "base" strings (numbered, they are used twice)
 					vec2.push_back("str"+std::to_string(i));
 					}
-			sqlite_query = "SELECT rstr FROM "+sqlite_table+" WHERE "+joinStr(vec, " AND ")+" ORDER BY RANDOM() LIMIT 1;";
+			// Random row is picked by our generator (last parameter is number in [0, 1)), so output is reproducible
+			std::string where = " WHERE "+joinStr(vec, " AND ");
+			sqlite_query = "SELECT rstr FROM "+sqlite_table+where+" ORDER BY rowid LIMIT 1 OFFSET CAST(?"+std::to_string(N+1)+" * (SELECT COUNT(*) FROM "+sqlite_table+where+") AS INTEGER);";
 			sqlite_insert = "INSERT INTO "+sqlite_table+" ("+joinStr(vec2, ", ")+") VALUES("+repeatDelim("?", ", ", N+1)+");";
 
 			sqlite_insert_dict = "INSERT INTO "+sqlite_table_dict+" (str) VALUES(?);";
@@ -226,7 +229,8 @@ namespace markov {
 		return str;
 		};
 
-	void markovBackend::trainBegin(std::vector<std::shared_ptr<std::ifstream>> arr) {
+	void markovBackend::trainBegin(std::vector<std::shared_ptr<generatorInput>> arr) {
+		TRACE_SPAN(trace, "sqlite.trainBegin");
 		auto&& db = *mainConnection;
 		db << "CREATE TABLE IF NOT EXISTS "+sqlite_table_dict+" (id INTEGER PRIMARY KEY ASC, str TEXT NOT NULL UNIQUE ON CONFLICT IGNORE);"; // id is only for human redactors via SqliteBrowser
 		db << "INSERT INTO "+sqlite_table_dict+"(rowid, str) VALUES(?, ?);" << 0 << ""; // Special value
@@ -249,7 +253,11 @@ namespace markov {
 			pstm++;
 			};
 		for (auto& file: arr) {
+				if (!file->rewindable()) { // `train` will fill dictionary for it on the fly
+						continue;
+						}
 				trainFile(file, dictAdd);
+				file->rewind(); // `train` will read it again
 				};
 		db << "commit;";
 		std::cout << "done!" << std::endl;
@@ -260,45 +268,47 @@ namespace markov {
 				}
 		};
 
-	void markovBackend::trainFile(std::shared_ptr<std::ifstream> file, std::function<void(const std::string&, const bool&)> func) {
-		std::string content;
-			{
-			file->seekg(0, std::ios::end);
-			content.reserve(file->tellg());
-			file->seekg(0, std::ios::beg);
-
-			content.assign((std::istreambuf_iterator<char>(*file)),
-						   std::istreambuf_iterator<char>());
-			}
-			{
-			if (separator != boost::regex("")) {
-					boost::sregex_token_iterator partsIter(content.begin(), content.end(), separator, -1);
+	void markovBackend::trainFile(std::shared_ptr<generatorInput> input, std::function<void(const std::string&, const bool&)> func) {
+		if (separator != boost::regex("")) { // Parts are independent
+				readBlocks(*input, separator, [this, &func](const char* begin, const char* end) {
+					TRACE_SPAN(trace, "sqlite.block");
+					boost::cregex_token_iterator partsIter(begin, end, separator, -1);
 					while (partsIter != xInvalidTokenIt) {
-							trainPart(*partsIter++, func);
+							auto part = *partsIter++;
+							trainPart(part.first, part.second, func);
 							}
-					}
-			else {
-					trainPart(content, func);
-					}
-			}
+					});
+				}
+		else { // Whole input is one part, context goes through blocks
+				readBlocks(*input, splitstr ? boost::regex("\n+") : boost::regex(iter), [this, &func](const char* begin, const char* end) {
+					TRACE_SPAN(trace, "sqlite.block");
+					trainLines(begin, end, func);
+					});
+				func("", true); // Insert end
+				}
 		}
 
-	void markovBackend::trainPart(const std::string& data, std::function<void(const std::string&, const bool&)> func) {
+	void markovBackend::trainPart(const char* begin, const char* end, std::function<void(const std::string&, const bool&)> func) {
+		trainLines(begin, end, func);
+		func("", true); // Insert end*/
+		};
+
+	void markovBackend::trainLines(const char* begin, const char* end, std::function<void(const std::string&, const bool&)> func) {
 		if (splitstr) {
-				boost::sregex_token_iterator linesIter(data.begin(), data.end(), boost::regex("\n+"), -1);
+				boost::cregex_token_iterator linesIter(begin, end, boost::regex("\n+"), -1);
 				while (linesIter != xInvalidTokenIt) {
-						trainFinal(*linesIter++, func);
+						auto line = *linesIter++;
+						trainFinal(line.first, line.second, func);
 						func("\n", false);
 						}
 				}
 		else {
-				trainFinal(data, func);
+				trainFinal(begin, end, func);
 				}
-		func("", true); // Insert end*/
 		};
 
-	void markovBackend::trainFinal(const std::string& data, std::function<void(const std::string&, const bool&)> func) {
-		boost::sregex_iterator blocksIter(data.begin(), data.end(), boost::regex(iter));
+	void markovBackend::trainFinal(const char* begin, const char* end, std::function<void(const std::string&, const bool&)> func) {
+		boost::cregex_iterator blocksIter(begin, end, boost::regex(iter));
 		while (blocksIter != xInvalidIt) {
 				func((blocksIter++)->str(), false);
 				}
@@ -314,7 +324,8 @@ namespace markov {
 		shiftDeque(dq, id);
 		}
 
-	boost::any markovBackend::train(std::shared_ptr<std::ifstream> file) {
+	boost::any markovBackend::train(std::shared_ptr<generatorInput> file) {
+		TRACE_SPAN(trace, "sqlite.train");
 		if (not mutex.try_lock()) {
 			std::cerr << "Error: NEVER use multithreading with SQLite3 backend";
 			std::terminate();
@@ -322,22 +333,32 @@ namespace markov {
 		auto db = connect();
 		*db << "begin;";
 		auto pstm = *db << sqlite_insert;
+		auto dictPstm = *db << sqlite_insert_dict;
+		bool dictAdd = !file->rewindable(); // Was not seen by `trainBegin`
 		MarkovDeque dq(N, 0);
-		auto func = [&db, &pstm, &dq, this](const std::string& str, bool reset) {
+		unsigned long long int tokens = 0;
+		auto func = [&db, &pstm, &dictPstm, dictAdd, &dq, &tokens, this](const std::string& str, bool reset) {
+			if (dictAdd) {
+					dictPstm << str;
+					dictPstm++;
+					}
 			trainInsert(str, *db, pstm, dq);
+			++tokens;
 			if (reset) {
 					dq = MarkovDeque(N, 0);
 				}
 			};
 		trainFile(file, func);
 		*db << "commit;";
-		file->close();
 		mutex.unlock();
+		count("train.tokens", tokens);
+		count("sql.statements", tokens * (dictAdd ? 3 : 2)); // Dictionary lookup and insert for every token (and dictionary insert for streams)
 
 		return true;
 		};
 
 	boost::any markovBackend::merge(std::vector<boost::any>&) {
+		TRACE_SPAN(trace, "sqlite.merge");
 		auto&& db = *mainConnection;
 		if (sqlite_index) {
 				std::cout << "Building data index (it can take some time)… ";
@@ -351,43 +372,64 @@ namespace markov {
 		return true;
 		};
 
-	void markovBackend::out(boost::any&, std::shared_ptr<std::ostream> o) {
+	void markovBackend::out(boost::any& data, std::shared_ptr<std::ostream> o) {
+		TRACE_SPAN(trace, "sqlite.out");
+		auto state = outBegin(data, outputSeed(0));
+		std::string piece;
+		while (outNext(*state, piece)) {
+				(*o) << piece;
+				}
+		};
+
+	markovState::~markovState() {
+		backend.count("out.tokens", n);
+		backend.count("sql.statements", n * 2 + 1); // Query and dictionary lookup for every token
+		};
+
+	std::unique_ptr<generatorState> markovBackend::outBegin(boost::any&, std::uint64_t seed) {
 		auto&& db = *mainConnection;
-		auto pstm = db << sqlite_query;
-		MarkovDeque dq;
+		auto state = std::make_unique<markovState>(*this, db, sqlite_query, seed);
 		if (rndstart) {
-				dq = MarkovDeque(N);
-				for (auto &&row : db << "SELECT * FROM "+sqlite_table+" ORDER BY RANDOM() LIMIT 1;") {
+				state->dq = MarkovDeque(N);
+				for (auto &&row : db << "SELECT * FROM "+sqlite_table+" ORDER BY rowid LIMIT 1 OFFSET CAST(? * (SELECT COUNT(*) FROM "+sqlite_table+") AS INTEGER);" << state->gen.real()) {
 						rowid_t id;
 						row >> id;
-						for (unsigned int i = 0; i < N; ++i) row >> dq[i];
+						for (unsigned int i = 0; i < N; ++i) row >> state->dq[i];
 						};
 				}
 		else {
-				dq = MarkovDeque(N, 0);
+				state->dq = MarkovDeque(N, 0);
 				}
-		rowid_t res = outGet(pstm, dq);
-		unsigned long long int n = 0;
-		while (res != 0) {
-				std::string str = dictStr(res, db);
-				(*o) << str;
-				if (str != "\n") {
-						(*o) << prefixmiddle;
-						};
-				if (maxgen > 0) {
-						if (++n == maxgen) {
-								return;
-								}; // We reached limit
-						}
-				shiftDeque(dq, res);
-				res = outGet(pstm, dq);
+		return state;
+		};
+
+	bool markovBackend::outNext(generatorState& Astate, std::string& piece) {
+		markovState& state = static_cast<markovState&>(Astate);
+		if (state.done) {
+				return false;
 				}
+		rowid_t res = outGet(state.pstm, state.dq, state.gen);
+		if (res == 0) { // End of text
+				state.done = true;
+				return false;
+				}
+		piece = dictStr(res, state.db);
+		if (piece != "\n") {
+				piece += prefixmiddle;
+				};
+		++state.n;
+		if (maxgen > 0 and state.n == maxgen) {
+				state.done = true;
+				}; // We reached limit
+		shiftDeque(state.dq, res);
+		return true;
 		};
 
-	rowid_t markovBackend::outGet(sqlite::database_binder& pstm, MarkovDeque& dq) {
+	rowid_t markovBackend::outGet(sqlite::database_binder& pstm, MarkovDeque& dq, generatorRandom& gen) {
 		for (int i = 1; i <= N; i++) {
 				pstm << dq.at(i-1);
 				}
+		pstm << gen.real(); // Where to pick among matching rows
 		rowid_t res = 0;
 		pstm >> res;
 		return res;
@@ -24,27 +24,62 @@ namespace markov {
 	using MarkovDeque = std::deque<std::string>;
 	template<typename T>
 	void shiftDeque(std::deque<T>&, T&);
+	class markovBackend;
+	class driverThread { // Connector/C++ must be told about every thread but main that uses it: threadInit before and threadEnd after
+		public:
+			explicit driverThread(sql::Driver* driver): driver(driver) { driver->threadInit(); };
+			~driverThread() { driver->threadEnd(); };
+			driverThread(const driverThread&) = delete;
+			driverThread& operator=(const driverThread&) = delete;
+		private:
+			sql::Driver* driver;
+	};
+	class markovState: public generatorState { // Walk through table by queries on own or borrowed connection
+		public:
+			markovState(markovBackend& backend, std::uint64_t seed): backend(backend), gen(seed) {};
+			~markovState();
+			markovBackend& backend;
+			std::unique_ptr<driverThread> ownThread; // With own connection, outlives it (state is used on thread that made it)
+			std::unique_ptr<sql::Connection> ownCon; // Empty if borrowed
+			std::unique_ptr<sql::PreparedStatement> ownPstm;
+			sql::Connection* con;
+			sql::PreparedStatement* pstm;
+			MarkovDeque dq;
+			generatorRandom gen;
+			unsigned long long int n = 0; // Tokens given
+			unsigned long long int statements = 0;
+			bool done = false;
+	};
 	class markovBackend: public generatorAPI { // We store most info inside SQL or class
 		public:
 			void init(std::vector<std::string>);
-			void trainBegin(std::vector<std::shared_ptr<std::ifstream>>) {};
-			boost::any train(std::shared_ptr<std::ifstream>);
+			void trainBegin(std::vector<std::shared_ptr<generatorInput>>) {};
+			boost::any train(std::shared_ptr<generatorInput>);
 			boost::any merge(std::vector<boost::any>&);
 			void out(boost::any&, std::shared_ptr<std::ostream>);
+			void outBatch(boost::any&, std::vector<std::shared_ptr<std::ostream>>&, std::uint64_t);
+			bool outConcurrent() { return true; };
+			std::unique_ptr<generatorState> outBegin(boost::any&, std::uint64_t);
+			bool outNext(generatorState&, std::string&);
 
 			boost::any load(std::string);
 			void save(std::string, boost::any&);
 
+			std::string_view::size_type chunkBoundary(std::string_view);
+
 		protected:
-			void trainPart(std::string, const std::unique_ptr<sql::Connection>&, const std::unique_ptr<sql::PreparedStatement>&);
-			void trainFinal(std::string, const std::unique_ptr<sql::Connection>&, const std::unique_ptr<sql::PreparedStatement>&, MarkovDeque&);
+			void trainPart(const char*, const char*, const std::unique_ptr<sql::Connection>&, const std::unique_ptr<sql::PreparedStatement>&);
+			void trainLines(const char*, const char*, const std::unique_ptr<sql::Connection>&, const std::unique_ptr<sql::PreparedStatement>&, MarkovDeque&);
+			void trainFinal(const char*, const char*, const std::unique_ptr<sql::Connection>&, const std::unique_ptr<sql::PreparedStatement>&, MarkovDeque&);
 			void trainInsert(std::string, const std::unique_ptr<sql::Connection>&, const std::unique_ptr<sql::PreparedStatement>&, MarkovDeque&);
 
 			void addIdx(const std::unique_ptr<sql::Connection>&);
 
 			std::unique_ptr<sql::Connection> mysql_connect();
 
-			std::string outGet(const std::unique_ptr<sql::Connection>&, const std::unique_ptr<sql::PreparedStatement>&, MarkovDeque&);
+			std::unique_ptr<markovState> outStart(sql::Connection&, sql::PreparedStatement&, std::uint64_t);
+			void outOne(generatorState&, std::shared_ptr<std::ostream>);
+			std::string outGet(sql::PreparedStatement&, MarkovDeque&, generatorRandom&);
 
 			std::string iter;
 			std::string prefixmiddle;
@@ -54,8 +89,8 @@ namespace markov {
 			bool rndstart;
 			boost::regex separator;
 
-			boost::sregex_token_iterator xInvalidTokenIt;
-			boost::sregex_iterator xInvalidIt;
+			boost::cregex_token_iterator xInvalidTokenIt;
+			boost::cregex_iterator xInvalidIt;
 
 			std::string mysql_endpoint;
 			std::string mysql_user;
@@ -1,4 +1,6 @@
 #include "interface.hpp"
+#include <inputBlocks.hpp>
+#include <chunkBoundary.hpp>
 #include <streambuf>
 #include <algorithm>
 #include <boost/dll/alias.hpp>
@@ -8,6 +10,12 @@
 namespace po = boost::program_options;
 
 namespace markov {
+	static thread_local unsigned long long int statements = 0; // Executed SQL statements, reported by `count`
+
+	static unsigned int randSeed(generatorRandom& gen) { // Seed for RAND(N) of MySQL
+		return gen() >> 33;
+	}
+
 	template<typename T>
 	void shiftDeque(std::deque<T> &dq, T &elem) {
 		dq.pop_front();
@@ -189,27 +197,32 @@ namespace markov {
 				vec.push_back("str"+std::to_string(i)+"=?"); // All "base" strings
 				vec2.push_back("str"+std::to_string(i));
 			}
-			mysql_query = "SELECT rstr FROM "+mysql_table+" WHERE "+joinStr(vec, " AND ")+" ORDER BY RAND() LIMIT 1;";
+			mysql_query = "SELECT rstr FROM "+mysql_table+" WHERE "+joinStr(vec, " AND ")+" ORDER BY RAND(?) LIMIT 1;"; // Seeded by our generator, so output is reproducible
 			mysql_insert = "INSERT INTO "+mysql_table+"("+joinStr(vec2, ", ")+") VALUES("+repeatDelim("?", ", ", N+1)+");";
 		}
 	};
 
-	void markovBackend::trainPart(std::string data, const std::unique_ptr<sql::Connection>& con, const std::unique_ptr<sql::PreparedStatement>& pstm) {
+	void markovBackend::trainPart(const char* begin, const char* end, const std::unique_ptr<sql::Connection>& con, const std::unique_ptr<sql::PreparedStatement>& pstm) {
 		MarkovDeque dq(N, "");
+		trainLines(begin, end, con, pstm, dq);
+		trainInsert("", con, pstm, dq); // Insert end*/
+	};
+
+	void markovBackend::trainLines(const char* begin, const char* end, const std::unique_ptr<sql::Connection>& con, const std::unique_ptr<sql::PreparedStatement>& pstm, MarkovDeque& dq) {
 		if (splitstr) {
-			boost::sregex_token_iterator linesIter(data.begin(), data.end(), boost::regex("\n+"), -1);
+			boost::cregex_token_iterator linesIter(begin, end, boost::regex("\n+"), -1);
 			while(linesIter != xInvalidTokenIt) {
-				trainFinal(*linesIter++, con, pstm, dq);
+				auto line = *linesIter++;
+				trainFinal(line.first, line.second, con, pstm, dq);
 				trainInsert("\n", con, pstm, dq);
 			}
 		} else {
-			trainFinal(data, con, pstm, dq);
+			trainFinal(begin, end, con, pstm, dq);
 		}
-		trainInsert("", con, pstm, dq); // Insert end*/
 	};
 
-	void markovBackend::trainFinal(std::string data, const std::unique_ptr<sql::Connection>& con, const std::unique_ptr<sql::PreparedStatement>& pstm, MarkovDeque& dq) {
-		boost::sregex_iterator blocksIter(data.begin(), data.end(), boost::regex(iter));
+	void markovBackend::trainFinal(const char* begin, const char* end, const std::unique_ptr<sql::Connection>& con, const std::unique_ptr<sql::PreparedStatement>& pstm, MarkovDeque& dq) {
+		boost::cregex_iterator blocksIter(begin, end, boost::regex(iter));
 		while (blocksIter != xInvalidIt) {
 			trainInsert((blocksIter++)->str(), con, pstm, dq);
 		}
@@ -221,12 +234,15 @@ namespace markov {
 			pstm->setString(i+1, dq.at(i-1));
 		}
 		pstm->execute();
+		++statements;
 		shiftDeque<std::string>(dq, data);
 	}
 
-	boost::any markovBackend::train(std::shared_ptr<std::ifstream> file) {
-		driver->threadInit();
+	boost::any markovBackend::train(std::shared_ptr<generatorInput> input) {
+		TRACE_SPAN(trace, "mysql.train");
+		unsigned long long int statementsBefore = statements; // Every insert is one token
 		{
+			driverThread thread(driver);
 			std::unique_ptr<sql::Connection> con = mysql_connect();
 			std::unique_ptr<sql::Statement> stm(con->createStatement());
 			stm->execute("SET AUTOCOMMIT=0;");
@@ -235,32 +251,36 @@ namespace markov {
 			}
 			stm->execute("START TRANSACTION;");
 			std::unique_ptr<sql::PreparedStatement> pstm(con->prepareStatement(mysql_insert));
-			std::string content;
 			{
-				file->seekg(0, std::ios::end);   
-				content.reserve(file->tellg());
-				file->seekg(0, std::ios::beg);
-
-				content.assign((std::istreambuf_iterator<char>(*file)),
-								std::istreambuf_iterator<char>());
-				file->close();
-			}
-			{
-				if (separator != boost::regex("")) {
-					boost::sregex_token_iterator partsIter(content.begin(), content.end(), separator, -1);
-					while(partsIter != xInvalidTokenIt) {
-						trainPart(*partsIter++, con, pstm);
-					}
-				} else {
-					trainPart(content, con, pstm);
+				if (separator != boost::regex("")) { // Parts are independent
+					readBlocks(*input, separator, [this, &con, &pstm](const char* begin, const char* end) {
+						TRACE_SPAN(trace, "mysql.block");
+						boost::cregex_token_iterator partsIter(begin, end, separator, -1);
+						while(partsIter != xInvalidTokenIt) {
+							auto part = *partsIter++;
+							trainPart(part.first, part.second, con, pstm);
+						}
+					});
+				} else { // Whole input is one part, context goes through blocks
+					MarkovDeque dq(N, "");
+					readBlocks(*input, splitstr ? boost::regex("\n+") : boost::regex(iter), [this, &con, &pstm, &dq](const char* begin, const char* end) {
+						TRACE_SPAN(trace, "mysql.block");
+						trainLines(begin, end, con, pstm, dq);
+					});
+					trainInsert("", con, pstm, dq); // Insert end
 				}
 			}
 			stm->execute("COMMIT;");
 		}
-		driver->threadEnd();
+		count("train.tokens", statements - statementsBefore);
+		count("sql.statements", statements - statementsBefore);
 		return true;
 	};
 
+	std::string_view::size_type markovBackend::chunkBoundary(std::string_view data) {
+		return markovChunkBoundary(data, separator, splitstr);
+	};
+
 	boost::any markovBackend::merge(std::vector<boost::any>&) {
 		return true;
 	};
@@ -278,39 +298,86 @@ namespace markov {
 		}
 	}
 
-	void markovBackend::out(boost::any&, std::shared_ptr<std::ostream> o) {
+	void markovBackend::out(boost::any& data, std::shared_ptr<std::ostream> o) {
+		outOne(*outBegin(data, outputSeed(0)), o);
+	};
+
+	void markovBackend::outBatch(boost::any&, std::vector<std::shared_ptr<std::ostream>>& outs, std::uint64_t first) {
+		driverThread thread(driver);
+		// One connection for whole batch
 		std::unique_ptr<sql::Connection> con = mysql_connect();
 		std::unique_ptr<sql::PreparedStatement> pstm(con->prepareStatement(mysql_query));
-		MarkovDeque dq;
+		for (std::size_t i = 0; i < outs.size(); ++i) {
+			outOne(*outStart(*con, *pstm, outputSeed(first + i)), outs[i]);
+		}
+	};
+
+	void markovBackend::outOne(generatorState& state, std::shared_ptr<std::ostream> o) {
+		TRACE_SPAN(trace, "mysql.outOne");
+		std::string piece;
+		while (outNext(state, piece)) {
+			(*o) << piece;
+		}
+	};
+
+	markovState::~markovState() {
+		backend.count("out.tokens", n);
+		backend.count("sql.statements", statements);
+	};
+
+	std::unique_ptr<generatorState> markovBackend::outBegin(boost::any&, std::uint64_t seed) { // Called on pool and server threads too (`outLimited`, streaming)
+		auto thread = std::make_unique<driverThread>(driver);
+		std::unique_ptr<sql::Connection> con = mysql_connect();
+		std::unique_ptr<sql::PreparedStatement> pstm(con->prepareStatement(mysql_query));
+		auto state = outStart(*con, *pstm, seed);
+		state->ownThread = std::move(thread);
+		state->ownCon = std::move(con);
+		state->ownPstm = std::move(pstm);
+		return state;
+	};
+
+	std::unique_ptr<markovState> markovBackend::outStart(sql::Connection& con, sql::PreparedStatement& pstm, std::uint64_t seed) {
+		auto state = std::make_unique<markovState>(*this, seed);
+		state->con = &con;
+		state->pstm = &pstm;
 		if (rndstart) {
-			dq = MarkovDeque(N);
-			std::unique_ptr<sql::Statement> stm(con->createStatement());
-			std::unique_ptr<sql::ResultSet> res(stm->executeQuery("SELECT * FROM "+mysql_table+" ORDER BY RAND() LIMIT 1;")); // Select one field
+			state->dq = MarkovDeque(N);
+			std::unique_ptr<sql::Statement> stm(con.createStatement());
+			std::unique_ptr<sql::ResultSet> res(stm->executeQuery("SELECT * FROM "+mysql_table+" ORDER BY RAND("+std::to_string(randSeed(state->gen))+") LIMIT 1;")); // Select one field
+			++state->statements;
 			res->next();
 			for (int i = 1; i <= N; i++) {
-				dq[i-1] = res->getString(i+1);
+				state->dq[i-1] = res->getString(i+1);
 			}
 		} else {
-			dq = MarkovDeque(N, "");
+			state->dq = MarkovDeque(N, "");
 		}
-		std::string str = outGet(con, pstm, dq);
-		unsigned long long int n = 0;
-		while(str != "") {
-			(*o) << str;
-			if (str != "\n") { (*o) << prefixmiddle; };
-			if (maxgen > 0) {
-				if (++n == maxgen) { return; }; // We reached limit
-			}
-			shiftDeque(dq, str);
-			str = outGet(con, pstm, dq);
+		return state;
+	};
+
+	bool markovBackend::outNext(generatorState& Astate, std::string& piece) {
+		markovState& state = static_cast<markovState&>(Astate);
+		if (state.done) { return false; }
+		std::string str = outGet(*state.pstm, state.dq, state.gen);
+		++state.statements;
+		if (str == "") { // End of text
+			state.done = true;
+			return false;
 		}
+		piece = str;
+		if (str != "\n") { piece += prefixmiddle; };
+		++state.n;
+		if (maxgen > 0 and state.n == maxgen) { state.done = true; }; // We reached limit
+		shiftDeque(state.dq, str);
+		return true;
 	};
 
-	std::string markovBackend::outGet(const std::unique_ptr<sql::Connection>&, const std::unique_ptr<sql::PreparedStatement>& pstm, MarkovDeque& dq) {
+	std::string markovBackend::outGet(sql::PreparedStatement& pstm, MarkovDeque& dq, generatorRandom& gen) {
 		for (int i = 1; i <= N; i++) {
-			pstm->setString(i, dq.at(i-1));
+			pstm.setString(i, dq.at(i-1));
 		}
-		std::unique_ptr<sql::ResultSet> res(pstm->executeQuery());
+		pstm.setUInt(N+1, randSeed(gen));
+		std::unique_ptr<sql::ResultSet> res(pstm.executeQuery());
 		if (res->rowsCount() == 0) { return ""; } // Not found at all, hopeless
 		else { res->next(); return res->getString(1); } // Return match
 	};
@@ -1,20 +1,141 @@
 #include <generatorAPI.hpp>
 #include <boost/dll/alias.hpp>
 
+#include <chrono>
+#include <ctime>
+#include <stdexcept>
+
+// Synthetic load: does no real work, only spends configured time and memory, so frontend overhead
+// (scheduling, passing results, loading backend) can be measured alone. Options are `-p key=value`, see `-p helpme`.
+
 namespace testBackendNamespace {
 
-	const std::string s = "Hey!";
+	using Payload = std::vector<char>;
+
+	struct option {
+		const char* name;
+		double value;
+		const char* help;
+	};
 
 	class testBackend: public generatorAPI {
 		public:
-			void init(std::vector<std::string>) {std::cout << "init() called" << std::endl;};
-			void trainBegin(std::vector<std::shared_ptr<std::ifstream>>) {std::cout << "trainBegin() called" << std::endl;};
-			boost::any train(std::shared_ptr<std::ifstream>) {std::cout << "train() called" << std::endl; return s;};
-			boost::any merge(std::vector<boost::any>&) {std::cout << "merge() called" << std::endl; return s;};
-			void out(boost::any&, std::shared_ptr<std::ostream>) {std::cout << "out() called" << std::endl;};
-
-			boost::any load(std::string) {std::cout << "load() called" << std::endl; return s;};
-			void save(std::string, boost::any&) {std::cout << "save() called" << std::endl;};
+			void init(std::vector<std::string> opts) {
+				for (auto const& opt: opts) {
+					if (opt == "helpme") {
+						std::cout << "Synthetic load backend, options are `-p key=value`:" << std::endl;
+						for (auto const& o: options) {
+							std::cout << "  " << o.name << " (" << o.value << ")\t" << o.help << std::endl;
+						}
+						exit(EXIT_SUCCESS);
+					}
+					auto eq = opt.find('=');
+					if (eq == std::string::npos) {
+						throw std::invalid_argument("test backend option `" + opt + "` is not key=value");
+					}
+					get(opt.substr(0, eq)) = std::stod(opt.substr(eq + 1));
+				}
+				log("init");
+			};
+			void trainBegin(std::vector<std::shared_ptr<generatorInput>>) { log("trainBegin"); };
+			boost::any train(std::shared_ptr<generatorInput> input) {
+				log("train");
+				// Touch every byte, as tokenizer would, then burn the rest of time given by rate
+				std::uintmax_t bytes = 0, lines = 0;
+				std::string_view piece;
+				while (input->read(piece)) {
+					bytes += piece.size();
+					lines += std::count(piece.begin(), piece.end(), '\n');
+				}
+				double rate = get("scan_rate");
+				burn(get("train_cpu_ms") / 1e3 + (rate > 0 ? bytes / rate : 0));
+				count("train.tokens", lines);
+				return Payload(get("train_payload"), char(lines));
+			};
+			boost::any merge(std::vector<boost::any>& vec) {
+				log("merge");
+				burn(get("merge_cpu_ms") / 1e3);
+				if (vec.size() == 1) {
+					return std::move(vec.front());
+				}
+				return Payload(get("merge_payload"));
+			};
+			void out(boost::any&, std::shared_ptr<std::ostream> o) {
+				log("out");
+				burn(get("out_cpu_us") / 1e6);
+				std::string text(get("out_bytes"), 'x');
+				(*o) << text;
+				count("out.tokens", text.size());
+			};
+			bool outConcurrent() { return true; };
+			bool mergeIncremental() { return get("merge_incremental") != 0; };
+			std::string_view::size_type chunkBoundary(std::string_view data) {
+				if (get("split") == 0) {
+					return std::string_view::npos;
+				}
+				auto pos = data.find('\n');
+				return pos == std::string_view::npos ? pos : pos + 1;
+			};
+
+			boost::any load(std::string) {
+				log("load");
+				std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(get("load_ms")));
+				return Payload(get("merge_payload"));
+			};
+			void save(std::string, boost::any&) {
+				log("save");
+				std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(get("save_ms")));
+			};
+
+		private:
+			std::vector<option> options = {
+				{"verbose", 1, "print name of every called function"},
+				{"scan_rate", 0, "train: bytes per second of CPU time (0 = only read input)"},
+				{"train_cpu_ms", 0, "train: extra CPU time per job"},
+				{"train_payload", 1024, "train: size of returned result, bytes"},
+				{"merge_cpu_ms", 0, "merge: CPU time per call"},
+				{"merge_payload", 1024, "merge/load: size of returned result, bytes"},
+				{"merge_incremental", 0, "ask frontend to merge results by pairs"},
+				{"split", 0, "allow splitting files into chunks (at any line)"},
+				{"out_cpu_us", 0, "out: CPU time per output"},
+				{"out_bytes", 16, "out: size of every output"},
+				{"save_ms", 0, "save: sleep (slow storage)"},
+				{"load_ms", 0, "load: sleep (slow storage)"},
+			};
+
+			double& get(const std::string& name) {
+				for (auto& o: options) {
+					if (name == o.name) {
+						return o.value;
+					}
+				}
+				throw std::invalid_argument("unknown test backend option `" + name + "`");
+			};
+
+			void log(const char* name) {
+				if (get("verbose") != 0) {
+					std::cout << name << "() called" << std::endl;
+				}
+			};
+
+			static double threadCpu() {
+				timespec ts;
+				clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+				return ts.tv_sec + ts.tv_nsec / 1e9;
+			};
+
+			static void burn(double seconds) { // Busy loop for given CPU time of calling thread
+				if (seconds <= 0) {
+					return;
+				}
+				double end = threadCpu() + seconds;
+				volatile std::uint64_t x = 1;
+				while (threadCpu() < end) {
+					for (int i = 0; i < 1000; ++i) {
+						x = x * 6364136223846793005ULL + 1;
+					}
+				}
+			};
 	};
 
 	testBackend backendInterface;